@@ -0,0 +1,59 @@
+/* What the benchmark drivers under bench/ share: timing a piece of code
+   over a number of runs, and bailing out when a result doesn't match what
+   it was checked against. The drivers print their numbers and exit
+   non-zero on a mismatch, so that a faster but wrong build stands out. */
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* Run f once and return the time it took, in microseconds. */
+template<typename F>
+double time_us(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - start;
+    return took.count();
+}
+
+/* Run f the given number of times and return the median time it took, in
+   microseconds. */
+template<typename F>
+double median_us(int runs, F f) {
+    std::vector<double> times;
+    for (int i = 0; i < runs; i++)
+        times.push_back(time_us(f));
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+inline void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "MISMATCH: " << what << std::endl;
+        exit(1);
+    }
+}
+
+/* A small, fixed pseudo random generator, so that every run of a driver
+   works on the same data. */
+class Random {
+public:
+    explicit Random(uint64_t seed): state(seed) { }
+    uint32_t operator()() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<uint32_t>(state);
+    }
+
+private:
+    uint64_t state;
+};
+
+#endif // BENCH_HPP
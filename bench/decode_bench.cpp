@@ -0,0 +1,158 @@
+/* Benchmark for taking in packets from neighbors: a burst of signed full
+   packets, one from every neighbor, as when all of them broadcast at about
+   the same time. The burst is checked and decoded on the main loop, as with
+   decode_threads at 0, and then through a DecodePool with a growing number
+   of threads. For each, this reports the packets per second overall and
+   the time the main loop spent per packet, submitting it, taking the
+   result and putting it in the NeighborTable. The trees that end up in the
+   table are checked against the ones that were sent.
+
+   The packets are made by broadcast() and come in over the loopback
+   interface, so this needs a UDP port on 127.0.0.1.
+
+   usage: decode_bench [neighbors [nodes per tree [max threads]]] */
+#include <cstdlib>
+#include <iostream>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "common.hpp"
+#include "DecodePool.hpp"
+
+static const int rounds = 20;
+
+/* The tree neighbor k sends: top nodes with ten children each. */
+static std::vector<NodePtr> neighbor_tree(uint32_t k, size_t nodes) {
+    std::vector<NodePtr> res;
+    uint32_t base = (k + 1) << 12;
+    for (uint32_t i = 0; i < nodes; i += 11) {
+        auto n = std::make_shared<Node>();
+        n->addr.s_addr = 0xac100000 + base + i;
+        n->metric = 10 + i % 50;
+        for (uint32_t j = 1; j <= 10 && i + j < nodes; j++) {
+            auto c = std::make_shared<Node>();
+            c->addr.s_addr = n->addr.s_addr + j;
+            c->metric = 10 + j;
+            n->children.push_back(c);
+        }
+        res.push_back(n);
+    }
+    return res;
+}
+
+static in_addr neighbor_addr(uint32_t k) {
+    return in_addr { 0xac100000 + k * 4 + 1 };
+}
+
+/* Make the signed packet for every tree, the way the daemon sends them. */
+static std::vector<std::vector<uint8_t>> make_packets(const std::vector<std::vector<NodePtr>> &trees) {
+    int rx = socket(AF_INET, SOCK_DGRAM, 0), tx = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in sin {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sin);
+    if (rx < 0 || tx < 0 || bind(rx, (sockaddr *)&sin, sizeof(sin)) < 0 || getsockname(rx, (sockaddr *)&sin, &len) < 0)
+        throw std::system_error(errno, std::system_category(), "loopback socket");
+    port = ntohs(sin.sin_port);
+    std::vector<Iface> ifaces;
+    ifaces.emplace_back("lo");
+    std::vector<std::vector<uint8_t>> res;
+    static uint8_t buf[65536];
+    for (auto &tree: trees) {
+        NeighborTable loopback;
+        Neighbor n {};
+        n.iface = 0;
+        n.addr.s_addr = INADDR_LOOPBACK;
+        loopback.insert(n);
+        broadcast(tx, tree, loopback, {}, ifaces);
+        auto got = recv(rx, buf, sizeof(buf), 0);
+        if (got < 0)
+            throw std::system_error(errno, std::system_category(), "recv");
+        res.emplace_back(buf, buf + got);
+    }
+    close(rx);
+    close(tx);
+    return res;
+}
+
+static void check_table(const NeighborTable &table, const std::vector<std::vector<NodePtr>> &trees) {
+    for (uint32_t k = 0; k < trees.size(); k++) {
+        auto n = table.find(neighbor_addr(k));
+        check(n && n->tree && same_tree(n->tree->children, trees[k]), "the tree of neighbor " + std::to_string(k));
+    }
+}
+
+static void report(const std::string &what, size_t packets, double total_us, double main_us) {
+    std::cout << what << ": " << packets * 1e6 / total_us << " packets/s, main loop " << main_us / packets << " us per packet" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_neighbors = argc > 1 ? atoi(argv[1]) : 64;
+    size_t nodes = argc > 2 ? atoi(argv[2]) : 200;
+    size_t max_threads = argc > 3 ? atoi(argv[3]) : 8;
+    openlog("decode_bench", LOG_PERROR, LOG_USER);
+    secret_key = "bench";
+
+    std::vector<std::vector<NodePtr>> trees;
+    for (uint32_t k = 0; k < num_neighbors; k++)
+        trees.push_back(neighbor_tree(k, nodes));
+    auto packets = make_packets(trees);
+    std::cout << num_neighbors << " neighbors, " << nodes << " nodes per tree, " << packets.front().size() << " bytes per packet" << std::endl;
+    size_t total = num_neighbors * rounds;
+
+    NeighborTable table;
+    auto inline_us = time_us([&] {
+        for (int round = 0; round < rounds; round++)
+            for (uint32_t k = 0; k < num_neighbors; k++) {
+                timeval now;
+                gettimeofday(&now, nullptr);
+                apply_packet(table, decode_packet(packets[k].data(), packets[k].size(), neighbor_addr(k), now, secret_key), 0);
+            }
+    });
+    check_table(table, trees);
+    report("inline", total, inline_us, inline_us);
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        int pipefds[2];
+        if (pipe(pipefds) < 0)
+            throw std::system_error(errno, std::system_category(), "pipe");
+        NeighborTable table;
+        double main_us = 0;
+        auto total_us = time_us([&] {
+            DecodePool pool(threads, pipefds[1]);
+            pool.set_key(secret_key);
+            for (int round = 0; round < rounds; round++) {
+                main_us += time_us([&] {
+                    for (uint32_t k = 0; k < num_neighbors; k++) {
+                        timeval now;
+                        gettimeofday(&now, nullptr);
+                        check(pool.submit(packets[k].data(), packets[k].size(), neighbor_addr(k), now), "a packet was dropped");
+                    }
+                });
+                size_t done = 0;
+                while (done < num_neighbors) {
+                    char c[256];
+                    auto n = read(pipefds[0], c, sizeof(c));
+                    main_us += time_us([&] {
+                        pool.take([&](DecodePool::Result &&result) {
+                            check(result.packet.has_value(), "decoding failed: " + result.error);
+                            apply_packet(table, std::move(*result.packet), 0);
+                            done++;
+                        });
+                    });
+                    if (n <= 0)
+                        throw std::system_error(errno, std::system_category(), "read");
+                }
+            }
+        });
+        close(pipefds[0]);
+        close(pipefds[1]);
+        check_table(table, trees);
+        report(std::to_string(threads) + (threads == 1 ? " thread" : " threads"), total, total_us, main_us);
+    }
+}
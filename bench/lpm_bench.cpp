@@ -0,0 +1,83 @@
+/* Benchmark for RouteTrie, the longest prefix match index: filtering the
+   routes that directly attached networks cover, as derive_routes_and_mytree()
+   does, and looking up single addresses, as the introspection queries do.
+   Both are checked against a brute force search over all routes.
+
+   usage: lpm_bench [direct nets [routes [lookups]]] */
+#include <cstdlib>
+#include <iostream>
+
+#include "bench.hpp"
+#include "Route.hpp"
+
+static Route random_route(Random &random, int min_netmask, int max_netmask) {
+    Route r;
+    r.netmask = min_netmask + random() % (max_netmask - min_netmask + 1);
+    r.addr.s_addr = (0xac100000 | (random() & 0xfffff)) & bitmask(r.netmask);
+    r.gateways = NextHops(in_addr { 0xac100000 | (random() & 0xfffff) });
+    return r;
+}
+
+/* The most specific route in the set that covers the given address, the
+   slow way. */
+static const Route *brute_lookup(const std::vector<Route> &routes, const in_addr &addr) {
+    const Route *best = nullptr;
+    for (auto &r: routes)
+        if (matches(r, addr) && (!best || r.netmask > best->netmask))
+            best = &r;
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_direct = argc > 1 ? atoi(argv[1]) : 4000;
+    size_t num_routes = argc > 2 ? atoi(argv[2]) : 20000;
+    size_t num_lookups = argc > 3 ? atoi(argv[3]) : 20000;
+
+    Random random(35);
+    RouteSet direct_nets, routes;
+    while (direct_nets.size() < num_direct)
+        direct_nets.insert(random_route(random, 28, 28));
+    while (routes.size() < num_routes)
+        routes.insert(random_route(random, 24, 32));
+
+    // what derive_routes_and_mytree() did before, a nested loop over both
+    RouteSet slow;
+    auto nested_us = median_us(1, [&] {
+        slow = routes;
+        slow.remove_if([&](const Route &route) {
+            for (const auto &direct: direct_nets)
+                if (matches(direct, route.addr))
+                    return true;
+            return false;
+        });
+    });
+    RouteSet fast;
+    auto trie_us = median_us(10, [&] {
+        fast = routes;
+        RouteTrie direct(direct_nets);
+        fast.remove_if([&](const Route &route) { return direct.lookup(route.addr) != nullptr; });
+    });
+    auto [deletes, adds, changes] = diff(slow, fast);
+    check(deletes.empty() && adds.empty() && changes.empty(), "filtering through the trie leaves other routes than the nested loop");
+    std::cout << num_direct << " direct nets, " << num_routes << " routes, " << fast.size() << " left after filtering" << std::endl;
+    std::cout << "filter, nested loop: " << nested_us << " us" << std::endl;
+    std::cout << "filter, trie (built every time): " << trie_us << " us" << std::endl;
+
+    std::vector<Route> all(routes.begin(), routes.end());
+    RouteTrie index(routes);
+    std::vector<in_addr> addrs;
+    for (size_t i = 0; i < num_lookups; i++)
+        addrs.push_back(in_addr { 0xac100000 | (random() & 0xfffff) });
+    size_t found = 0;
+    auto lookup_us = median_us(10, [&] {
+        found = 0;
+        for (auto &a: addrs)
+            found += index.lookup(a) != nullptr;
+    });
+    for (auto &a: addrs) {
+        auto expected = brute_lookup(all, a);
+        auto got = index.lookup(a);
+        check(!expected == !got && (!got || route_key(*got) == route_key(*expected)), "lookup of " + show(a));
+    }
+    std::cout << num_lookups << " lookups, " << found << " covered: " << lookup_us * 1000 / num_lookups << " ns per lookup" << std::endl;
+}
@@ -0,0 +1,108 @@
+/* Benchmark for the merge kernels behind diff(), intersection() and
+   difference() on route tables the size of a core router's, with a bit of
+   churn between the old and the new table, as from one compute run to the
+   next. The results are checked against the same operations on a
+   std::map.
+
+   The kernel is picked when Route.cpp is compiled, so to time the vector
+   ones, build with them enabled, e.g. with CXXFLAGS=-mavx2 for CMake or
+   BENCH_FLAGS=-mavx2 for make.
+
+   usage: routeset_bench [routes [churn in per mille]] */
+#include <cstdlib>
+#include <iostream>
+#include <map>
+
+#include "bench.hpp"
+#include "Route.hpp"
+
+using Table = std::map<RouteKey, NextHops>;
+
+static Table to_table(const RouteSet &set) {
+    Table res;
+    for (const auto &route: set)
+        res.emplace(route_key(route), route.gateways);
+    return res;
+}
+
+static bool same(const RouteSet &set, const Table &table) {
+    return to_table(set) == table;
+}
+
+static const char *kernel() {
+#if defined(__AVX2__)
+    return "AVX2";
+#elif defined(__SSE4_2__)
+    return "SSE4.2";
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_routes = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t churn = argc > 2 ? atoi(argv[2]) : 10;
+
+    Random random(39);
+    auto next_hop = [&] { return NextHops(in_addr { 0xac100000 | (random() & 0xfffff) }); };
+    RouteSet old_routes;
+    while (old_routes.size() < num_routes) {
+        Route r;
+        r.netmask = 24 + random() % 9;
+        r.addr.s_addr = (0xac100000 | (random() & 0xfffff)) & bitmask(r.netmask);
+        r.gateways = next_hop();
+        old_routes.insert(r);
+    }
+    // a new table with churn per mille of the routes dropped, added or sent elsewhere
+    RouteSet new_routes;
+    for (const auto &route: old_routes) {
+        auto r = route;
+        auto dice = random() % 1000;
+        if (dice < churn / 3)
+            continue;
+        if (dice < 2 * churn / 3)
+            r.gateways = next_hop();
+        else if (dice < churn) {
+            auto extra = r;
+            extra.netmask = 32;
+            extra.addr.s_addr |= 1;
+            new_routes.insert(extra);
+        }
+        new_routes.insert(r);
+    }
+
+    auto old_table = to_table(old_routes), new_table = to_table(new_routes);
+    Table deletes, adds, changes, both, only_old;
+    for (auto &[key, gateways]: old_table) {
+        auto it = new_table.find(key);
+        if (it == new_table.end())
+            deletes.emplace(key, gateways);
+        else {
+            both.emplace(key, gateways);
+            if (it->second != gateways)
+                changes.emplace(key, it->second);
+        }
+        if (it == new_table.end() || it->second != gateways)
+            only_old.emplace(key, gateways);
+    }
+    for (auto &[key, gateways]: new_table)
+        if (!old_table.count(key))
+            adds.emplace(key, gateways);
+
+    std::tuple<RouteSet, RouteSet, RouteSet> d;
+    RouteSet i, o;
+    auto diff_us = median_us(20, [&] { d = diff(old_routes, new_routes); });
+    auto intersection_us = median_us(20, [&] { i = intersection(old_routes, new_routes); });
+    auto difference_us = median_us(20, [&] { o = difference(old_routes, new_routes); });
+    check(same(std::get<0>(d), deletes) && same(std::get<1>(d), adds) && same(std::get<2>(d), changes), "diff()");
+    check(same(i, both), "intersection()");
+    check(same(o, only_old), "difference()");
+
+    std::cout << kernel() << " kernel, " << old_routes.size() << " old routes, " << new_routes.size() << " new, "
+              << deletes.size() << " deletes, " << adds.size() << " adds, " << changes.size() << " changes" << std::endl;
+    std::cout << "diff: " << diff_us << " us" << std::endl;
+    std::cout << "intersection: " << intersection_us << " us" << std::endl;
+    std::cout << "difference: " << difference_us << " us" << std::endl;
+}
@@ -0,0 +1,103 @@
+/* Scratch memory for the data a route computation only needs while it runs.
+   Every run builds the same kind of temporary maps, queues and lists, about
+   as big as last time, so rather than going to malloc for every node of
+   every one of them, they take their memory from an arena that's rewound
+   between runs. Once the arena has grown to what a run needs, a run over a
+   network that didn't grow doesn't allocate any scratch memory at all. */
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/* A monotonic allocator: allocate() bumps a pointer, and memory is only
+   given back, all at once, by reset(). The chunks are kept for the next run.
+   An Arena is only ever used by one thread. */
+class Arena {
+public:
+    explicit Arena(size_t chunk_size = 64 * 1024): chunk_size(chunk_size) { }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t align) {
+        while (current < chunks.size()) {
+            auto &chunk = chunks[current];
+            auto p = (reinterpret_cast<uintptr_t>(chunk.data.get()) + offset + align - 1) & ~(align - 1);
+            auto end = reinterpret_cast<uintptr_t>(chunk.data.get()) + chunk.size;
+            if (p + size <= end) {
+                offset = p + size - reinterpret_cast<uintptr_t>(chunk.data.get());
+                return reinterpret_cast<void *>(p);
+            }
+            current++;
+            offset = 0;
+        }
+        // out of chunks. add one that's at least twice as big as the last one
+        auto size_needed = size + align;
+        auto new_size = chunks.empty() ? chunk_size : 2 * chunks.back().size;
+        while (new_size < size_needed)
+            new_size *= 2;
+        chunks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[new_size]), new_size });
+        current = chunks.size() - 1;
+        offset = 0;
+        return allocate(size, align);
+    }
+
+    /* Forget about everything allocated so far. Whatever was built in the
+       arena must be gone by now. */
+    void reset() {
+        current = 0;
+        offset = 0;
+    }
+
+    /* How much memory the arena holds on to. */
+    size_t capacity() const {
+        size_t res = 0;
+        for (auto &chunk: chunks)
+            res += chunk.size;
+        return res;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+    size_t chunk_size;
+    std::vector<Chunk> chunks;
+    size_t current = 0; // the chunk allocations come from
+    size_t offset = 0;  // and where in that chunk
+};
+
+/* A standard allocator on top of an Arena, for containers of scratch data.
+   Deallocation does nothing; the memory comes back when the arena is
+   reset. */
+template<typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena &arena) noexcept: arena(&arena) { }
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) noexcept: arena(other.arena) { }
+
+    T *allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_alloc();
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) noexcept { }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+    Arena *arena;
+};
+
+template<typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif // ARENA_HPP
@@ -0,0 +1,187 @@
+#include "Config.hpp"
+
+#include <fstream>
+#include <functional>
+
+#include <arpa/inet.h>
+
+#include "Route.hpp"
+#include "Trace.hpp"
+
+Config current_config() {
+    Config c;
+    c.port = port;
+    c.broadcast_interval = broadcast_interval;
+    c.broadcast_min_interval = broadcast_min_interval;
+    c.broadcast_redundancy = broadcast_redundancy;
+    c.alarm_timeout = alarm_timeout;
+    c.interlink_netmask = interlink_netmask;
+    c.minimum_netmask = minimum_netmask;
+    c.max_multipath = max_multipath;
+    c.default_multipath = default_multipath;
+    c.gateway_margin = gateway_margin;
+    c.optimal_aggregation = optimal_aggregation;
+    c.min_holddown = min_holddown;
+    c.max_holddown = max_holddown;
+    c.secret_key = secret_key;
+    c.gateway = false;
+    c.multicast_group = multicast_group;
+    c.snapshot_file = snapshot_file;
+    c.decode_threads = decode_threads;
+    c.trace = tracing;
+    c.trace_file = trace_file;
+    c.damping_half_life = damping_half_life;
+    c.damping_max_suppress = damping_max_suppress;
+    c.capture_packets = capture_packets;
+    c.real_route_updates = real_route_updates;
+    c.use_syslog = use_syslog;
+    c.stay_in_foreground = stay_in_foreground;
+    return c;
+}
+
+static std::string trim(const std::string &s) {
+    auto begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos)
+        return "";
+    return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+}
+
+Settings read_settings(const std::string &path) {
+    Settings res;
+    std::ifstream ifs(path);
+    std::string line;
+    for (int lineno = 1; std::getline(ifs, line); lineno++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        auto pos = line.find('=');
+        if (pos == std::string::npos)
+            throw std::runtime_error(path + ":" + std::to_string(lineno) + ": expected name = value");
+        res[trim(line.substr(0, pos))] = trim(line.substr(pos + 1));
+    }
+    return res;
+}
+
+static int to_int(const std::string &name, const std::string &value, int min, int max) {
+    size_t end;
+    int res;
+    try {
+        res = std::stoi(value, &end);
+    } catch (std::logic_error &) {
+        end = 0;
+    }
+    if (end == 0 || end != value.length() || res < min || res > max)
+        throw std::runtime_error(name + " must be a number from " + std::to_string(min) + " to " + std::to_string(max));
+    return res;
+}
+
+static bool to_bool(const std::string &name, const std::string &value) {
+    if (value == "yes" || value == "true" || value == "1")
+        return true;
+    if (value == "no" || value == "false" || value == "0")
+        return false;
+    throw std::runtime_error(name + " must be yes or no");
+}
+
+static std::set<std::string> to_list(const std::string &value) {
+    std::set<std::string> res;
+    size_t begin = 0;
+    while (begin <= value.length()) {
+        auto end = value.find(',', begin);
+        if (end == std::string::npos)
+            end = value.length();
+        if (auto item = trim(value.substr(begin, end - begin)); !item.empty())
+            res.insert(item);
+        begin = end + 1;
+    }
+    return res;
+}
+
+static in_addr to_addr(const std::string &name, const std::string &value) {
+    in_addr a;
+    if (inet_aton(value.data(), &a) == 0)
+        throw std::runtime_error("Invalid address for " + name + ": " + value);
+    return in_addr { ntohl(a.s_addr) };
+}
+
+Config parse_settings(const Settings &settings, Config c) {
+    const std::map<std::string, std::function<void (const std::string &, const std::string &)>> parsers {
+        { "port", [&](auto &n, auto &v) { c.port = to_int(n, v, 1, 65535); } },
+        { "broadcast_interval", [&](auto &n, auto &v) { c.broadcast_interval = to_int(n, v, 1, 3600); } },
+        { "broadcast_min_interval", [&](auto &n, auto &v) { c.broadcast_min_interval = to_int(n, v, 1, 3600000); } },
+        { "broadcast_redundancy", [&](auto &n, auto &v) { c.broadcast_redundancy = to_int(n, v, 0, 1000); } },
+        { "alarm_timeout", [&](auto &n, auto &v) { c.alarm_timeout = to_int(n, v, 1, 3600); } },
+        { "interlink_netmask", [&](auto &n, auto &v) { c.interlink_netmask = to_int(n, v, 0, 32); } },
+        { "minimum_netmask", [&](auto &n, auto &v) { c.minimum_netmask = to_int(n, v, 0, 32); } },
+        { "max_multipath", [&](auto &n, auto &v) { c.max_multipath = to_int(n, v, 1, NextHops::capacity); } },
+        { "default_multipath", [&](auto &n, auto &v) { c.default_multipath = to_int(n, v, 1, NextHops::capacity); } },
+        { "gateway_margin", [&](auto &n, auto &v) { c.gateway_margin = to_int(n, v, 0, 65535); } },
+        { "optimal_aggregation", [&](auto &n, auto &v) { c.optimal_aggregation = to_bool(n, v); } },
+        { "min_holddown", [&](auto &n, auto &v) { c.min_holddown = to_int(n, v, 1, 3600000); } },
+        { "max_holddown", [&](auto &n, auto &v) { c.max_holddown = to_int(n, v, 1, 3600000); } },
+        { "secret_key", [&](auto &, auto &v) { c.secret_key = v; } },
+        { "gateway", [&](auto &n, auto &v) { c.gateway = to_bool(n, v); } },
+        { "default_gateways", [&](auto &n, auto &v) {
+            c.default_gateways.clear();
+            for (auto &a: to_list(v))
+                c.default_gateways.insert(to_addr(n, a));
+        } },
+        { "zero_hop_interfaces", [&](auto &, auto &v) { c.zero_hop_ifaces = to_list(v); } },
+        { "multicast_interfaces", [&](auto &, auto &v) { c.multicast_ifaces = to_list(v); } },
+        { "multicast_group", [&](auto &n, auto &v) {
+            c.multicast_group = to_addr(n, v);
+            if (!IN_MULTICAST(c.multicast_group.s_addr))
+                throw std::runtime_error("Not a multicast group: " + v);
+        } },
+        { "snapshot_file", [&](auto &, auto &v) { c.snapshot_file = v; } },
+        { "decode_threads", [&](auto &n, auto &v) { c.decode_threads = to_int(n, v, 0, 64); } },
+        { "trace", [&](auto &n, auto &v) { c.trace = to_bool(n, v); } },
+        { "trace_file", [&](auto &, auto &v) { c.trace_file = v; } },
+        { "damping_half_life", [&](auto &n, auto &v) { c.damping_half_life = to_int(n, v, 0, 3600); } },
+        { "damping_max_suppress", [&](auto &n, auto &v) { c.damping_max_suppress = to_int(n, v, 0, 86400); } },
+        { "capture_packets", [&](auto &n, auto &v) { c.capture_packets = to_bool(n, v); } },
+        { "real_route_updates", [&](auto &n, auto &v) { c.real_route_updates = to_bool(n, v); } },
+        { "syslog", [&](auto &n, auto &v) { c.use_syslog = to_bool(n, v); } },
+        { "foreground", [&](auto &n, auto &v) { c.stay_in_foreground = to_bool(n, v); } },
+    };
+    for (auto &[name, value]: settings) {
+        auto it = parsers.find(name);
+        if (it == parsers.end())
+            throw std::runtime_error("Unknown setting " + name);
+        it->second(name, value);
+    }
+    if (c.max_holddown < c.min_holddown)
+        throw std::runtime_error("max_holddown must be at least min_holddown");
+    if (c.broadcast_min_interval > c.broadcast_interval * 1000)
+        throw std::runtime_error("broadcast_min_interval must be at most broadcast_interval");
+    return c;
+}
+
+void apply_globals(const Config &c) {
+    port = c.port;
+    broadcast_interval = c.broadcast_interval;
+    timeout = 8 * c.broadcast_interval;
+    broadcast_min_interval = c.broadcast_min_interval;
+    broadcast_redundancy = c.broadcast_redundancy;
+    alarm_timeout = c.alarm_timeout;
+    interlink_netmask = c.interlink_netmask;
+    minimum_netmask = c.minimum_netmask;
+    max_multipath = c.max_multipath;
+    default_multipath = c.default_multipath;
+    gateway_margin = c.gateway_margin;
+    optimal_aggregation = c.optimal_aggregation;
+    min_holddown = c.min_holddown;
+    max_holddown = c.max_holddown;
+    secret_key = c.secret_key;
+    multicast_group = c.multicast_group;
+    snapshot_file = c.snapshot_file;
+    decode_threads = c.decode_threads;
+    tracing = c.trace;
+    trace_file = c.trace_file;
+    damping_half_life = c.damping_half_life;
+    damping_max_suppress = c.damping_max_suppress;
+    capture_packets = c.capture_packets;
+    real_route_updates = c.real_route_updates;
+    use_syslog = c.use_syslog;
+    stay_in_foreground = c.stay_in_foreground;
+}
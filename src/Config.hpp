@@ -0,0 +1,71 @@
+/* This module reads the configuration. Settings come from the config file
+   and from the command line, which overrides the file. Both end up as the
+   same name/value pairs, so that they're checked the same way, and a reload
+   can tell exactly which settings changed. */
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "common.hpp"
+
+/* Settings by name, as strings. */
+using Settings = std::map<std::string, std::string>;
+
+struct Config {
+    int port;
+    int broadcast_interval;
+    int broadcast_min_interval;
+    int broadcast_redundancy;
+    int alarm_timeout;
+    int interlink_netmask;
+    int minimum_netmask;
+    int max_multipath;
+    int default_multipath;
+    int gateway_margin;
+    bool optimal_aggregation;
+    int min_holddown;
+    int max_holddown;
+    std::string secret_key;
+    bool gateway;
+    InAddrSet default_gateways;
+    std::set<std::string> zero_hop_ifaces;
+    std::set<std::string> multicast_ifaces;
+    in_addr multicast_group;
+    std::string snapshot_file;
+    int decode_threads;
+    bool trace;
+    std::string trace_file;
+    int damping_half_life;
+    int damping_max_suppress;
+    bool capture_packets;
+    bool real_route_updates;
+    bool use_syslog;
+    bool stay_in_foreground;
+};
+
+/* The configuration as it is in the globals in common.hpp. Called before
+   anything is applied, this gives the built-in defaults. */
+Config current_config();
+
+/* Read the settings in the given file. Every line is "name = value", and
+   anything after a '#' is a comment. A file that doesn't exist has no
+   settings in it. Throws a runtime_error on a line that makes no sense.
+
+   The names are those of the members of Config, except that the interface
+   lists are zero_hop_interfaces and multicast_interfaces, and use_syslog and
+   stay_in_foreground are syslog and foreground. Lists are separated by
+   commas and booleans are yes or no. */
+Settings read_settings(const std::string &path);
+
+/* Apply the given settings on top of the given configuration. Throws a
+   runtime_error on an unknown name or an invalid value, without having
+   changed anything. */
+Config parse_settings(const Settings &, Config);
+
+/* Set the globals in common.hpp from the given configuration. */
+void apply_globals(const Config &);
+
+#endif // CONFIG_HPP
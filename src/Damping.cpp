@@ -0,0 +1,127 @@
+#include "Damping.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <syslog.h>
+
+static std::string show_key(RouteKey key) {
+    return show(in_addr { static_cast<in_addr_t>(key >> 6) }) + "/" + std::to_string(key & 63);
+}
+
+Damping::Damping(std::chrono::seconds half_life, std::chrono::seconds max_suppress) {
+    set_limits(half_life, max_suppress);
+}
+
+void Damping::set_limits(std::chrono::seconds half_life, std::chrono::seconds max_suppress) {
+    this->half_life = half_life;
+    if (half_life.count() == 0) {
+        entries.clear();
+        any_suppressed = false;
+        previous.clear();
+        current.clear();
+        ceiling = 0;
+        return;
+    }
+    // a penalty at the ceiling takes max_suppress to decay to the reuse limit
+    auto half_lives = std::min(30.0, static_cast<double>(max_suppress.count()) / half_life.count());
+    ceiling = std::max(suppress_limit, reuse_limit * std::exp2(half_lives));
+}
+
+double Damping::decayed(const Entry &entry, Clock::time_point now) const {
+    std::chrono::duration<double> elapsed = now - entry.updated;
+    return entry.penalty * std::exp2(-elapsed.count() / half_life.count());
+}
+
+void Damping::charge(RouteKey key, double penalty, Clock::time_point now) {
+    auto &entry = entries.emplace(key, Entry { 0, now, false }).first->second;
+    entry.penalty = std::min(ceiling, entry.penalty + penalty);
+    if (!entry.suppressed && entry.penalty > suppress_limit) {
+        syslog(LOG_INFO, "Suppressing flapping route to %s", show_key(key).data());
+        entry.suppressed = true;
+    }
+}
+
+void Damping::apply(ScratchVector<Route> &routes, Clock::time_point now) {
+    if (half_life.count() == 0)
+        return;
+
+    for (auto it = entries.begin(); it != entries.end(); ) {
+        auto &entry = it->second;
+        entry.penalty = decayed(entry, now);
+        entry.updated = now;
+        if (entry.suppressed && entry.penalty < reuse_limit) {
+            syslog(LOG_INFO, "Reusing route to %s", show_key(it->first).data());
+            entry.suppressed = false;
+        }
+        // like the RFC, forget about a destination once it's well below reuse
+        if (!entry.suppressed && entry.penalty < reuse_limit / 2)
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+
+    // the host routes are sorted and unique, so they go in as they are
+    current.clear();
+    current.reserve(routes.size());
+    for (auto &route: routes)
+        current.push_back(route_key(route), route.gateways);
+    auto [withdrawn, added, changed] = diff(previous, current);
+    for (size_t i = 0; i < withdrawn.size(); i++)
+        charge(withdrawn.key(i), withdrawal_penalty, now);
+    for (size_t i = 0; i < changed.size(); i++)
+        charge(changed.key(i), change_penalty, now);
+    std::swap(previous, current);
+
+    any_suppressed = std::any_of(entries.begin(), entries.end(), [](auto &e) { return e.second.suppressed; });
+    if (any_suppressed)
+        routes.erase(std::remove_if(routes.begin(), routes.end(), [this](const Route &route) {
+            return suppressed(route_key(route));
+        }), routes.end());
+}
+
+void Damping::prune(std::vector<NodePtr> &tree) const {
+    if (!any_suppressed)
+        return;
+    if (auto res = pruned(tree))
+        tree = std::move(*res);
+}
+
+/* The given nodes with the suppressed ones left out, or nothing if there's
+   nothing to leave out anywhere under them. */
+std::optional<std::vector<NodePtr>> Damping::pruned(const std::vector<NodePtr> &nodes) const {
+    std::optional<std::vector<NodePtr>> res;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        auto &node = nodes[i];
+        NodePtr keep = node;
+        if (suppressed(route_key(node->addr, 32)))
+            keep = nullptr;
+        else if (auto children = pruned(node->children)) {
+            auto copy = std::make_shared<Node>();
+            copy->addr = node->addr;
+            copy->ethernet = node->ethernet;
+            copy->gateway = node->gateway;
+            copy->metric = node->metric;
+            copy->children = std::move(*children);
+            keep = std::move(copy);
+        }
+        if (keep != node && !res)
+            res.emplace(nodes.begin(), nodes.begin() + i);
+        if (res && keep)
+            res->push_back(std::move(keep));
+    }
+    return res;
+}
+
+bool Damping::suppressed(RouteKey key) const {
+    auto it = entries.find(key);
+    return it != entries.end() && it->second.suppressed;
+}
+
+void Damping::print(std::ostream &os) const {
+    for (auto &[key, entry]: entries) {
+        os << show_key(key) << " penalty " << std::lround(entry.penalty);
+        if (entry.suppressed)
+            os << " suppressed";
+        os << std::endl;
+    }
+}
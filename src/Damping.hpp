@@ -0,0 +1,79 @@
+/* This module damps route flaps, the way RFC 2439 does for BGP. A radio
+   link that keeps going up and down makes the routes behind it come and go
+   with it, and every time that's a round of kernel route changes. Here
+   every destination collects a penalty for each time its route goes away
+   or changes gateways. The penalty decays exponentially, and while it's
+   high the destination is suppressed: whatever the route computation says,
+   it gets no route and isn't in the tree we advertise, until the penalty
+   has decayed to the reuse limit.
+
+   As in the RFC, a withdrawal always goes through at once, so a route to a
+   destination that's gone never stays around to blackhole or loop its
+   traffic. Only putting a flapping destination back is held off. */
+#ifndef DAMPING_HPP
+#define DAMPING_HPP
+
+#include <map>
+#include <optional>
+#include <ostream>
+#include <vector>
+
+#include "Route.hpp"
+#include "Scheduler.hpp"
+#include "Tree.hpp"
+
+/* The penalties and limits, from RFC 2439. A single flap doesn't suppress a
+   destination, three in quick succession do. */
+constexpr double withdrawal_penalty = 1000;
+constexpr double change_penalty = 500;
+constexpr double suppress_limit = 2000;
+constexpr double reuse_limit = 750;
+
+class Damping {
+public:
+    /* Penalties halve every half_life. The penalty is capped so that a
+       destination is suppressed for at most max_suppress after its last
+       flap. A half_life of zero turns damping off. */
+    Damping(std::chrono::seconds half_life, std::chrono::seconds max_suppress);
+
+    /* Change the half-life and maximum suppression time. Turning damping off
+       forgets all penalties. */
+    void set_limits(std::chrono::seconds half_life, std::chrono::seconds max_suppress);
+
+    /* Charge the destinations whose routes went away or changed gateways
+       since the previous call, and take the routes of the suppressed ones
+       out. The routes are the host routes from merge(), sorted on address,
+       before aggregation and every time all of them. */
+    void apply(ScratchVector<Route> &routes, Clock::time_point now);
+
+    /* Leave the suppressed destinations out of the given tree, as of the
+       last apply(), along with everything that hangs under them. The nodes
+       are shared with whoever else has the tree, so the ones above a
+       suppressed node are copied rather than changed. */
+    void prune(std::vector<NodePtr> &tree) const;
+
+    /* Is the destination with the given key suppressed? */
+    bool suppressed(RouteKey) const;
+
+    /* Write the destinations that carry a penalty, one per line, with their
+       penalty as of the last apply() and whether they're suppressed. */
+    void print(std::ostream &) const;
+
+private:
+    struct Entry {
+        double penalty;
+        Clock::time_point updated;
+        bool suppressed;
+    };
+    double decayed(const Entry &, Clock::time_point now) const;
+    void charge(RouteKey, double penalty, Clock::time_point now);
+    std::optional<std::vector<NodePtr>> pruned(const std::vector<NodePtr> &) const;
+
+    std::chrono::seconds half_life;
+    double ceiling;
+    std::map<RouteKey, Entry> entries;
+    bool any_suppressed = false;
+    RouteSet previous, current; // the routes of the last two calls, before damping
+};
+
+#endif // DAMPING_HPP
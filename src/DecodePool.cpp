@@ -0,0 +1,75 @@
+#include "DecodePool.hpp"
+
+#include <chrono>
+
+#include <syslog.h>
+#include <unistd.h>
+
+#include "Trace.hpp"
+
+DecodePool::DecodePool(size_t num_threads, int notify_fd)
+        : notify_fd(notify_fd), key(std::make_shared<const std::string>()) {
+    for (size_t i = 0; i < num_threads; i++)
+        threads.push_back(std::make_unique<Thread>());
+    // only start them once they're all there
+    for (auto &thread: threads)
+        thread->thread = std::thread([this, &t = *thread] { run(t); });
+}
+
+DecodePool::~DecodePool() {
+    stopping = true;
+    for (auto &thread: threads) {
+        {
+            std::lock_guard<std::mutex> l(thread->mutex);
+        }
+        thread->cv.notify_one();
+        thread->thread.join();
+    }
+}
+
+void DecodePool::set_key(const std::string &k) {
+    key = std::make_shared<const std::string>(k);
+}
+
+bool DecodePool::submit(const uint8_t *buffer, size_t len, const in_addr &addr, const timeval &received) {
+    // Fibonacci hashing, as in NeighborTable, spreads a subnet's worth of neighbors evenly
+    auto h = static_cast<uint32_t>(addr.s_addr * 2654435769u);
+    auto &thread = *threads[(static_cast<uint64_t>(h) * threads.size()) >> 32];
+    Job job { std::vector<uint8_t>(buffer, buffer + len), addr, received, key };
+    if (!thread.in.push(std::move(job)))
+        return false;
+    {
+        // the thread checks its queue with this held before it goes to sleep, so it can't miss the push
+        std::lock_guard<std::mutex> l(thread.mutex);
+    }
+    thread.cv.notify_one();
+    return true;
+}
+
+void DecodePool::run(Thread &thread) {
+    trace_thread_name("decode");
+    while (!stopping) {
+        auto job = thread.in.pop();
+        if (!job) {
+            std::unique_lock<std::mutex> l(thread.mutex);
+            thread.cv.wait(l, [&] { return stopping || !thread.in.empty(); });
+            continue;
+        }
+        Result result;
+        result.addr = job->addr;
+        try {
+            result.packet = decode_packet(job->data.data(), job->data.size(), job->addr, job->received, *job->key);
+        } catch (std::runtime_error &ex) {
+            result.error = ex.what();
+        } // anything else is as much a reason to crash here as it is in the main loop
+        // the main loop empties this on every notification, so it can only be full for a moment
+        while (!thread.out.push(std::move(result))) {
+            if (stopping)
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // nonblocking. if the pipe is full there's a wakeup pending anyway.
+        char c = 0;
+        (void)write(notify_fd, &c, 1);
+    }
+}
@@ -0,0 +1,89 @@
+/* This module checks and decodes packets from neighbors on a few threads of
+   their own. When all neighbors send their trees at about the same time, a
+   node with many of them would otherwise spend a good while verifying
+   signatures and decoding trees back to back on the main loop, and not
+   look at the routing socket in the meantime. */
+#ifndef DECODEPOOL_HPP
+#define DECODEPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Neighbor.hpp"
+#include "SpscQueue.hpp"
+
+/* Packets are spread over the threads by sender address, so all packets
+   from one neighbor go through the same thread, and come out in the order
+   they went in. Every thread has a queue in from the main loop and a queue
+   back to it, both lock-free. The main loop only takes a lock to wake a
+   thread that has run out of work, which the thread never holds for long.
+
+   Every time a packet is done, a byte is written to notify_fd, so that the
+   main loop can select() on the other end of a pipe, and pick up what's
+   done with take(). */
+class DecodePool {
+public:
+    /* What came out of a packet: the decoded packet, or what was wrong with
+       it. */
+    struct Result {
+        in_addr addr;
+        std::optional<Packet> packet;
+        std::string error;
+    };
+
+    DecodePool(size_t threads, int notify_fd);
+    DecodePool(const DecodePool &) = delete;
+    DecodePool &operator=(const DecodePool &) = delete;
+    ~DecodePool();
+
+    /* The key that packets are signed with, for the packets that are
+       submitted from now on. */
+    void set_key(const std::string &);
+
+    /* Hand over a packet received from the given address at the given time.
+       Returns false, and drops the packet, if the thread that it goes to is
+       too far behind. */
+    bool submit(const uint8_t *, size_t, const in_addr &, const timeval &received);
+
+    /* Call the given function with every result that's ready, the ones from
+       one neighbor in order. */
+    template<typename F>
+    void take(F f) {
+        for (auto &thread: threads)
+            while (auto result = thread->out.pop())
+                f(std::move(*result));
+    }
+
+    size_t size() const { return threads.size(); }
+
+private:
+    struct Job {
+        std::vector<uint8_t> data;
+        in_addr addr;
+        timeval received;
+        std::shared_ptr<const std::string> key;
+    };
+    struct Thread {
+        Thread(): in(queue_size), out(queue_size) { }
+        SpscQueue<Job> in;
+        SpscQueue<Result> out;
+        std::mutex mutex; // only for waiting on cv
+        std::condition_variable cv;
+        std::thread thread;
+    };
+    static constexpr size_t queue_size = 1024;
+
+    void run(Thread &);
+
+    int notify_fd;
+    std::shared_ptr<const std::string> key;
+    std::atomic<bool> stopping { false };
+    std::vector<std::unique_ptr<Thread>> threads;
+};
+
+#endif // DECODEPOOL_HPP
@@ -0,0 +1,78 @@
+#include "Discovery.hpp"
+
+#include <algorithm>
+
+/* Probes back off from the broadcast interval up to this many seconds. */
+static constexpr int max_probe_interval = 3600;
+
+void Discovery::clear() {
+    candidates.clear();
+    stations.clear();
+}
+
+void Discovery::add_subnet(IfaceIndex iface, const in_addr &self, int netmask) {
+    auto mask = bitmask(netmask);
+    auto masked = self.s_addr & mask;
+    // for all addresses in this block but the network and broadcast ones
+    for (auto a = masked + 1; ((a + 1) & mask) == masked; ++a)
+        if (a != self.s_addr)
+            candidates.try_emplace(in_addr { a }, Candidate { iface });
+}
+
+std::optional<IfaceIndex> Discovery::iface_for(const in_addr &addr) const {
+    auto it = candidates.find(addr);
+    if (it == candidates.end())
+        return std::nullopt;
+    return it->second.iface;
+}
+
+bool Discovery::hint(const in_addr &addr) {
+    auto it = candidates.find(addr);
+    if (it == candidates.end() || it->second.hinted)
+        return false;
+    it->second.hinted = true;
+    return true;
+}
+
+void Discovery::station(IfaceIndex iface, const ether_addr &mac) {
+    if (!stations[iface].insert(mac).second)
+        return;
+    for (auto &[addr, candidate]: candidates)
+        if (candidate.iface == iface && !candidate.neighbor)
+            candidate.next_probe = 0;
+}
+
+void Discovery::found(const in_addr &addr) {
+    auto it = candidates.find(addr);
+    if (it != candidates.end())
+        it->second.neighbor = true;
+}
+
+void Discovery::lost(const in_addr &addr, time_t now) {
+    auto it = candidates.find(addr);
+    if (it == candidates.end())
+        return;
+    it->second.neighbor = false;
+    it->second.interval = broadcast_interval;
+    it->second.next_probe = now + broadcast_interval;
+}
+
+std::vector<in_addr> Discovery::strangers() const {
+    std::vector<in_addr> res;
+    for (auto &[addr, candidate]: candidates)
+        if (!candidate.neighbor)
+            res.push_back(addr);
+    return res;
+}
+
+std::vector<in_addr> Discovery::due(time_t now) {
+    std::vector<in_addr> res;
+    for (auto &[addr, candidate]: candidates) {
+        if (candidate.neighbor || candidate.next_probe > now)
+            continue;
+        res.push_back(addr);
+        candidate.interval = std::clamp(candidate.interval * 2, broadcast_interval, max_probe_interval);
+        candidate.next_probe = now + candidate.interval;
+    }
+    return res;
+}
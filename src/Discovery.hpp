@@ -0,0 +1,72 @@
+/* This module keeps track of the addresses in our interlink subnets that
+   aren't neighbors yet, and decides when to probe them. Rather than sending
+   the tree to every address in every subnet on every broadcast, an address
+   only becomes a neighbor once there's a sign of life from it, and until
+   then it gets probed at exponentially growing intervals. */
+#ifndef DISCOVERY_HPP
+#define DISCOVERY_HPP
+
+#include <map>
+#include <optional>
+#include <vector>
+#include <ctime>
+
+#include "common.hpp"
+#include "Iface.hpp"
+#include "MAC.hpp"
+
+class Discovery {
+public:
+    /* Forget all subnets and candidates, to start over with a new config. */
+    void clear();
+
+    /* Add the subnet of the given address and netmask on the given interface.
+       All addresses in it other than our own become candidates, due for a
+       probe right away. */
+    void add_subnet(IfaceIndex, const in_addr &self, int netmask);
+
+    /* The interface a neighbor with the given address would be on, or
+       nothing if it's not in one of the subnets. */
+    std::optional<IfaceIndex> iface_for(const in_addr &) const;
+
+    /* Something other than a packet suggests there's a host at the given
+       address: an ARP entry or an associated station. Returns whether that
+       should make it a neighbor, which is the case the first time for every
+       candidate. A host that doesn't run lvrouted stays in the ARP table, so
+       after it's been dropped again it has to answer a probe to come back. */
+    bool hint(const in_addr &);
+
+    /* A station associated to the given interface. If it's new, the
+       candidates on that interface are probed at the next broadcast, even if
+       there's no ARP entry that tells which one it is. */
+    void station(IfaceIndex, const ether_addr &);
+
+    /* The given address became a neighbor. Stop probing it. */
+    void found(const in_addr &);
+
+    /* The neighbor at the given address has been dropped. Probe it again,
+       starting at the shortest interval. */
+    void lost(const in_addr &, time_t now);
+
+    /* All candidates that aren't neighbors, whether they're due for a probe
+       or not. */
+    std::vector<in_addr> strangers() const;
+
+    /* The candidates due for a probe at the given time. Each of them is
+       backed off until its next one. */
+    std::vector<in_addr> due(time_t now);
+
+private:
+    struct Candidate {
+        IfaceIndex iface;
+        bool neighbor = false;
+        bool hinted = false;
+        time_t next_probe = 0;
+        int interval = 0;
+    };
+
+    InAddrMap<Candidate> candidates;
+    std::map<IfaceIndex, EtherAddrSet> stations;
+};
+
+#endif // DISCOVERY_HPP
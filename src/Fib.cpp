@@ -0,0 +1,194 @@
+#include "Fib.hpp"
+#include "Trace.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <net/route.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef __FreeBSD__
+ShadowFib::ShadowFib(): fd(socket(PF_ROUTE, SOCK_RAW, AF_INET)) {
+    if (fd.fd == -1)
+        throw std::system_error(errno, std::system_category(), "open routing socket");
+    // the answers to what we send come back on the same socket
+    if (int i = 1; setsockopt(fd.fd, SOL_SOCKET, SO_USELOOPBACK, &i, sizeof(i)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(SO_USELOOPBACK)");
+    // messages we miss because the buffer filled up go unnoticed until the next audit
+    if (int size = 1024 * 1024; setsockopt(fd.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+        syslog(LOG_WARNING, "Couldn't enlarge the routing socket buffer: %s", strerror(errno));
+#ifdef ROUTE_MSGFILTER
+    unsigned int filter = ROUTE_FILTER(RTM_ADD) | ROUTE_FILTER(RTM_DELETE) | ROUTE_FILTER(RTM_CHANGE);
+    setsockopt(fd.fd, PF_ROUTE, ROUTE_MSGFILTER, &filter, sizeof(filter));
+#endif
+    audit();
+}
+#else
+ShadowFib::ShadowFib(): fd(-1) { }
+#endif
+
+void ShadowFib::update() {
+#ifdef __FreeBSD__
+    uint8_t buffer[65536];
+    for (;;) {
+        auto len = recv(fd.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                syslog(LOG_WARNING, "Error reading route message: %s", strerror(errno));
+                stale = true;
+            }
+            break;
+        }
+        receive(buffer, len);
+    }
+    if (stale || Clock::now() - last_audit >= fib_audit_interval)
+        audit();
+#endif
+}
+
+void ShadowFib::program(const RouteSet &routes) {
+    TraceSpan span("program", nullptr, routes.size());
+#ifdef __FreeBSD__
+    update();
+    for (int i = 0; i < 5; i++) {
+        auto [deletes, adds, changes] = diff(shadow, routes);
+        if (deletes.empty() && adds.empty() && changes.empty())
+            return;
+        TraceSpan attempt("commit attempt", nullptr, i);
+        syslog(LOG_DEBUG, "Committing %zu deletes, %zu adds and %zu changes", deletes.size(), adds.size(), changes.size());
+        for (const auto &add: adds)
+            for (auto &gw: add.gateways)
+                send(RTM_ADD, add, gw);
+        for (const auto &del: deletes)
+            for (auto &gw: del.gateways)
+                send(RTM_DELETE, del, gw);
+        for (const auto &change: changes) {
+            auto old = shadow[shadow.find(change).index()];
+            if (old.gateways.size() == 1 && change.gateways.size() == 1) {
+                send(RTM_CHANGE, change, change.gateways.front());
+                continue;
+            }
+            for (auto &gw: change.gateways)
+                if (!old.gateways.contains(gw))
+                    send(RTM_ADD, change, gw);
+            for (auto &gw: old.gateways)
+                if (!change.gateways.contains(gw))
+                    send(RTM_DELETE, old, gw);
+        }
+        wait_for_replies();
+        // something we sent or heard back made the copy unreliable. the next
+        // attempt, or the check below, goes by a fresh dump instead
+        if (stale)
+            update();
+    }
+    auto [deletes, adds, changes] = diff(shadow, routes);
+    if (!deletes.empty() || !adds.empty() || !changes.empty())
+        syslog(LOG_WARNING, "Gave up on %zu deletes, %zu adds and %zu changes", deletes.size(), adds.size(), changes.size());
+#endif
+}
+
+#ifdef __FreeBSD__
+void ShadowFib::send(int type, const Route &route, const in_addr &gateway) {
+    uint8_t buffer[sizeof(rt_msghdr) + 3 * sizeof(sockaddr_in)];
+    auto len = route_message(buffer, type, route, gateway, seq);
+    if (write(fd.fd, buffer, len) == static_cast<ssize_t>(len)) {
+        pending.insert(seq++);
+        return;
+    }
+    // the kernel said no right away. the echo that follows is ignored.
+    auto error = errno;
+    seq++;
+    Route path = route;
+    path.gateways = NextHops(gateway);
+    if (error == ESRCH && type != RTM_ADD)
+        apply(RTM_DELETE, path); // it wasn't there, so it isn't now
+    else {
+        syslog(LOG_DEBUG, "Route message for %s failed: %s", show(path).data(), strerror(error));
+        if (error == EEXIST)
+            stale = true; // there's something there we didn't know about
+    }
+}
+
+void ShadowFib::wait_for_replies() {
+    uint8_t buffer[65536];
+    auto deadline = Clock::now() + fib_reply_timeout;
+    while (!pending.empty()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        if (left <= 0)
+            break;
+        pollfd p { fd.fd, POLLIN, 0 };
+        if (poll(&p, 1, static_cast<int>(left)) <= 0)
+            continue;
+        auto len = recv(fd.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len > 0)
+            receive(buffer, len);
+    }
+    if (!pending.empty()) {
+        syslog(LOG_WARNING, "The kernel didn't answer %zu route messages", pending.size());
+        pending.clear();
+        stale = true;
+    }
+}
+
+void ShadowFib::receive(const uint8_t *buffer, size_t len) {
+    auto rtm = reinterpret_cast<const rt_msghdr *>(buffer);
+    if (len < sizeof(*rtm) || rtm->rtm_version != RTM_VERSION)
+        return;
+    bool ours = rtm->rtm_pid == getpid();
+    if (ours && !pending.erase(rtm->rtm_seq))
+        return; // an answer we stopped waiting for, or to a message that failed
+    auto route = parse_route_message(rtm, len);
+    if (rtm->rtm_errno != 0) {
+        if (!ours)
+            return; // somebody else's that didn't work
+        if (rtm->rtm_errno == ESRCH && rtm->rtm_type != RTM_ADD && route)
+            apply(RTM_DELETE, *route);
+        else if (rtm->rtm_errno == EEXIST)
+            stale = true;
+        return;
+    }
+    if (route)
+        apply(rtm->rtm_type, *route);
+}
+
+void ShadowFib::apply(int type, const Route &route) {
+    auto gateway = route.gateways.front();
+    auto it = shadow.find(route);
+    switch (type) {
+    case RTM_ADD:
+        if (it == shadow.end())
+            shadow.insert(route);
+        else shadow.gateways(it.index()).insert(gateway);
+        break;
+    case RTM_CHANGE:
+        if (it == shadow.end())
+            shadow.insert(route);
+        else shadow.gateways(it.index()) = route.gateways;
+        break;
+    case RTM_DELETE:
+        if (it != shadow.end() && shadow.gateways(it.index()).erase(gateway) && shadow.gateways(it.index()).empty())
+            shadow.erase(it);
+        break;
+    }
+}
+
+void ShadowFib::audit() {
+    TraceSpan span("audit");
+    auto kernel = fetch();
+    if (!stale) {
+        auto [deletes, adds, changes] = diff(shadow, kernel);
+        if (!deletes.empty() || !adds.empty() || !changes.empty())
+            syslog(LOG_WARNING, "The kernel had %zu routes fewer, %zu more and %zu different than we thought",
+                   deletes.size(), adds.size(), changes.size());
+    }
+    shadow = std::move(kernel);
+    stale = false;
+    last_audit = Clock::now();
+}
+#endif
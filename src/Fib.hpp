@@ -0,0 +1,69 @@
+/* This module keeps a copy of the routes we have in the kernel, so that
+   programming the routes doesn't start with dumping the whole kernel route
+   table, and checking that it worked doesn't take dumping it again. On a
+   router that also carries BGP or a lot of static routes, that's a big
+   table to go over every run for the handful of routes that changed.
+
+   The copy is kept up to date from the messages on a routing socket of its
+   own: the answers to what we send, which say whether it worked, and what
+   anybody else does to the same kind of routes. A full dump is only done
+   now and then, to check that the copy didn't drift. */
+#ifndef FIB_HPP
+#define FIB_HPP
+
+#include <chrono>
+#include <set>
+
+#include "Route.hpp"
+#include "Scheduler.hpp"
+
+/* How often the copy is checked against a full dump. */
+constexpr auto fib_audit_interval = std::chrono::minutes(5);
+
+/* How long to wait for the kernel to answer the messages we sent. */
+constexpr auto fib_reply_timeout = std::chrono::seconds(1);
+
+/* The routes of the kind fetch() returns, as the kernel has them. Only ever
+   used by one thread. */
+class ShadowFib {
+public:
+    /* Open a routing socket and start from a full dump. Throws a
+       system_error if either doesn't work. */
+    ShadowFib();
+    ShadowFib(const ShadowFib &) = delete;
+    ShadowFib &operator=(const ShadowFib &) = delete;
+
+    /* The routes in the kernel, as of the last update() or program(). */
+    const RouteSet &routes() const { return shadow; }
+
+    /* Take in the routing messages that came in since the last call. Does a
+       full dump instead if an audit is due, or if the copy can't be trusted
+       because the kernel didn't answer or said something unexpected. */
+    void update();
+
+    /* Get the kernel to have the given routes, sending only the difference
+       with the copy, and wait for the kernel to confirm every message. What
+       didn't work is tried again, up to five times, starting from a fresh
+       dump if the copy can't be trusted anymore. Routes with more than one
+       gateway are installed as one kernel route per path, which a kernel
+       with ROUTE_MPATH groups into a multipath route. A change to or from a
+       multipath route deletes the paths that went away and adds the new
+       ones, rather than using RTM_CHANGE. */
+    void program(const RouteSet &);
+
+private:
+    void send(int type, const Route &, const in_addr &gateway);
+    void wait_for_replies();
+    void receive(const uint8_t *, size_t);
+    void apply(int type, const Route &);
+    void audit();
+
+    FileDescriptor fd;
+    RouteSet shadow;
+    std::set<int> pending; // sequence numbers of the messages not answered yet
+    int seq = 1;
+    bool stale = true; // until the first dump
+    Clock::time_point last_audit;
+};
+
+#endif // FIB_HPP
@@ -13,11 +13,16 @@ enum class IfaceType {
 			    // associated stations for a specific client
 };
 
+/* Interfaces are referred to by their index in the table of interfaces. */
+using IfaceIndex = uint16_t;
+
 struct Iface {
     explicit Iface(std::string);
     
     std::string name;
     IfaceType type; 
+    in_addr addr;   // one of its addresses, host byte order
+    bool multicast = false; // send the tree to multicast_group instead of to every neighbor
 
     time_t last_associated_update;
     time_t last_arp_update;
@@ -1,9 +1,13 @@
 #include <cstring>
 #include <cassert>
 #include "Neighbor.hpp"
+#include "Trace.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <time.h>
+#include <sys/time.h>
 #include <openssl/sha.h>
 #include <sys/socket.h>
 #include <system_error>
@@ -12,29 +16,129 @@
 #include <cassert>
 #include <cstring>
 
-void broadcast(int fd, const std::vector<Node> &tree, NeighborSet &neighbors) {
-    uint8_t buffer[65536];
-    Node n;
-    n.addr.s_addr = 0;
-    n.children = tree;
-    
-    auto p = &buffer[SHA_DIGEST_LENGTH];
-    *(time_t *)p = time(nullptr);
-    p += sizeof(time_t);
-    auto len = serialize(n, p, &buffer[65536] - p);
-    
+/* What follows the signature in every packet, in network byte order. The
+   signature covers just this. The tree that follows in a full packet is
+   tied to it by its digest, so that a tree is hashed once when it changes
+   rather than for every packet, and a keepalive or a solicitation is this
+   header alone. */
+struct PacketHeader {
+    uint32_t version;
+    uint32_t kind;
+    uint32_t seqno;
+    uint32_t timestamp_sec;
+    uint32_t timestamp_usec;
+    uint32_t tree_version;
+    uint8_t tree_digest[SHA_DIGEST_LENGTH];
+};
+static constexpr uint32_t packet_version = 4;
+static constexpr size_t header_len = SHA_DIGEST_LENGTH + sizeof(PacketHeader);
+
+/* How many broadcasts go by between sending everybody the full tree. Well
+   within the time it takes a tree to expire. */
+static constexpr uint32_t full_tree_every = 4;
+
+/* Parameters for the link quality estimation. Moving averages take an
+ * eighth of every new sample. A gap in the sequence numbers larger than
+ * max_counted_loss is taken to be a restart of the neighbor rather than
+ * loss. The base delay creeps up by 1/64th of the difference so that clock
+ * drift between two nodes doesn't end up looking like a queue.
+ *
+ * The metric that goes into the tree is rounded to metric_step, and only
+ * moves once the measured one is a full step or metric_hysteresis of it
+ * away, so that jitter doesn't change our tree with every broadcast.
+ */
+static constexpr double link_alpha = 1.0 / 8;
+static constexpr uint32_t max_counted_loss = 16;
+static constexpr int64_t base_delay_creep = 64;
+static constexpr int64_t ms_per_delay_point = 10;
+static constexpr double metric_step = 5;
+static constexpr double metric_hysteresis = 0.1;
+
+static double measured_metric(const LinkStats &link) {
+    auto delivery = std::max(link.delivery, 0.01);
+    auto metric = 10 / (delivery * delivery) + link.excess_delay / ms_per_delay_point;
+    return std::clamp(metric, 10.0, 65535.0);
+}
+
+static uint16_t rounded_metric(double metric) {
+    return static_cast<uint16_t>(std::clamp(std::round(metric / metric_step) * metric_step, 10.0, 65535.0));
+}
+
+static void sign(const std::string &key, const PacketHeader &header, uint8_t *md) {
     SHA_CTX sha;
     if (!SHA1_Init(&sha))
         throw std::runtime_error("SHA1_Init");
-    if (!secret_key.empty()) {
-        if (!SHA1_Update(&sha, secret_key.data(), secret_key.length()))
+    if (!key.empty()) {
+        if (!SHA1_Update(&sha, key.data(), key.length()))
             throw std::runtime_error("SHA1_Update");
     }
-    if (!SHA1_Update(&sha, &buffer[SHA_DIGEST_LENGTH], len + sizeof(time_t)))
+    if (!SHA1_Update(&sha, &header, sizeof(header)))
         throw std::runtime_error("SHA1_Update");
-    if (!SHA1_Final(&buffer[0], &sha))
+    if (!SHA1_Final(md, &sha))
         throw std::runtime_error("SHA1_Final");
-    
+}
+
+/* Our tree as last sent, encoded, with its digest and version. Shared by
+   broadcasts and answers to solicitations. */
+static struct {
+    std::vector<NodePtr> tree;
+    std::vector<uint8_t> body;
+    TreeDigest digest;
+    uint32_t version = 0;
+} ours;
+/* Sequence number of the next broadcast. */
+static uint32_t seqno = 0;
+
+/* Bring ours up to date with the given tree. The tree is only encoded when
+   it's a different one, and only gets a new version if it encodes to
+   something different. */
+static void encode_tree(const std::vector<NodePtr> &tree) {
+    if (ours.version != 0 && same_tree(tree, ours.tree))
+        return;
+    Node n;
+    n.addr.s_addr = 0;
+    n.metric = 0;
+    n.children = tree;
+    std::vector<uint8_t> body(serialized_size(n));
+    if (body.size() > 65536 - header_len)
+        throw std::runtime_error("Tree too big for a packet");
+    serialize(n, body.data(), body.size());
+    // a recomputation that came up with the same tree isn't a new version
+    if (ours.version == 0 || body != ours.body) {
+        ours.body = std::move(body);
+        SHA1(ours.body.data(), ours.body.size(), ours.digest.data());
+        ours.version++;
+    }
+    ours.tree = tree;
+}
+
+/* Write a signed packet of the given kind to the given buffer, which has
+   room for the largest one, and return its length. Only full packets and
+   replies carry the tree. */
+static size_t make_packet(uint8_t *buffer, PacketKind kind, uint32_t seqno) {
+    timeval now;
+    gettimeofday(&now, nullptr);
+    PacketHeader header {
+        htonl(packet_version),
+        htonl(static_cast<uint32_t>(kind)),
+        htonl(seqno),
+        htonl(static_cast<uint32_t>(now.tv_sec)),
+        htonl(static_cast<uint32_t>(now.tv_usec)),
+        htonl(ours.version),
+        { 0 },
+    };
+    memcpy(header.tree_digest, ours.digest.data(), ours.digest.size());
+    sign(secret_key, header, &buffer[0]);
+    memcpy(&buffer[SHA_DIGEST_LENGTH], &header, sizeof(header));
+    if (kind != PacketKind::Full && kind != PacketKind::Reply)
+        return header_len;
+    memcpy(&buffer[header_len], ours.body.data(), ours.body.size());
+    return header_len + ours.body.size();
+}
+
+/* Send a packet to the given address. Returns false if there's nobody
+   there, and throws a system_error if something else went wrong. */
+static bool send_packet(int fd, const in_addr &addr, const uint8_t *packet, size_t len) {
     assert(!compress_data);
     sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
@@ -43,75 +147,308 @@ void broadcast(int fd, const std::vector<Node> &tree, NeighborSet &neighbors) {
 #endif
     sin.sin_family = AF_INET;
     sin.sin_port = htons(port);
-    NeighborSet to_delete;
-    for (auto &neighbor: neighbors) {
-        sin.sin_addr.s_addr = htonl(neighbor.addr.s_addr);
-        if (sendto(fd, &buffer[0], SHA_DIGEST_LENGTH + sizeof(time_t) + len, 0, (const sockaddr *)&sin, sizeof(sin)) == -1) {
-            switch (errno) {
-            case EHOSTUNREACH:
-            case EHOSTDOWN:
-            case ECONNREFUSED:
-            case ENETDOWN:
-                to_delete.insert(neighbor);
-                break;
-            default:
-                throw std::system_error(errno, std::system_category(), "sendto");
-            }
+    sin.sin_addr.s_addr = htonl(addr.s_addr);
+    if (sendto(fd, packet, len, 0, (const sockaddr *)&sin, sizeof(sin)) == -1) {
+        switch (errno) {
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+        case ECONNREFUSED:
+        case ENETDOWN:
+            return false;
+        default:
+            throw std::system_error(errno, std::system_category(), "sendto");
         }
     }
-    if (!to_delete.empty()) {
-        NeighborSet new_ns;
-        std::set_difference(neighbors.begin(), neighbors.end(), to_delete.begin(), to_delete.end(), std::inserter(new_ns, new_ns.begin()), NeighborLess());
-        neighbors = std::move(new_ns);
+    return true;
+}
+
+/* Point the multicast packets that follow at the given interface. */
+static void multicast_on(int fd, const Iface &iface) {
+    in_addr a { htonl(iface.addr.s_addr) };
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &a, sizeof(a)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(IP_MULTICAST_IF)");
+}
+
+/* Fibonacci hashing: the top bits of the product are well mixed even for
+   consecutive addresses, which is what neighbors in a subnet tend to be. */
+size_t NeighborTable::slot_for(in_addr_t addr) const {
+    auto mask = slots.size() - 1;
+    size_t i = static_cast<uint32_t>(addr * 2654435769u) >> (32 - slot_bits);
+    while (slots[i] && entries[slots[i] - 1].addr.s_addr != addr)
+        i = (i + 1) & mask;
+    return i;
+}
+
+void NeighborTable::rebuild() {
+    // keep the load factor at or below a half, so that probe runs stay short
+    slot_bits = 4;
+    while ((size_t(1) << slot_bits) < entries.size() * 2)
+        slot_bits++;
+    slots.assign(size_t(1) << slot_bits, 0);
+    for (auto &list: by_iface)
+        list.clear();
+    for (uint32_t i = 0; i < entries.size(); i++) {
+        slots[slot_for(entries[i].addr.s_addr)] = i + 1;
+        if (entries[i].iface >= by_iface.size())
+            by_iface.resize(entries[i].iface + 1);
+        by_iface[entries[i].iface].push_back(i);
     }
 }
 
-void handle_data(NeighborSet &neighbors, const uint8_t *buffer, ssize_t len, const in_addr &addr) {
-    {
-        in_addr a { htonl(addr.s_addr) };
-        std::ofstream ofs(std::string("/tmp/packet-") + inet_ntoa(a));
-        ofs.write((const char *)buffer, len);
+Neighbor *NeighborTable::find(const in_addr &addr) {
+    if (slots.empty())
+        return nullptr;
+    auto slot = slots[slot_for(addr.s_addr)];
+    return slot ? &entries[slot - 1] : nullptr;
+}
+
+const Neighbor *NeighborTable::find(const in_addr &addr) const {
+    return const_cast<NeighborTable *>(this)->find(addr);
+}
+
+Neighbor &NeighborTable::insert(Neighbor neighbor) {
+    if (auto existing = find(neighbor.addr))
+        return *existing;
+    uint32_t i = entries.size();
+    entries.push_back(std::move(neighbor));
+    if (entries.size() * 2 > slots.size()) {
+        rebuild();
+    } else {
+        slots[slot_for(entries[i].addr.s_addr)] = i + 1;
+        if (entries[i].iface >= by_iface.size())
+            by_iface.resize(entries[i].iface + 1);
+        by_iface[entries[i].iface].push_back(i);
     }
-    if (len <= SHA_DIGEST_LENGTH)
-        throw std::runtime_error(std::string("Short packet from ") + inet_ntoa(addr));
-    
-    auto &neighbor = [&]() -> const Neighbor & {
-        Neighbor n;
-        n.addr = addr;
-        auto it = neighbors.find(n);
-        if (it == neighbors.end())
-            throw std::runtime_error(std::string("Packet from unknown neighbor ") + inet_ntoa(addr));
-        return *it;
-    }();
-    
-    SHA_CTX sha;
-    if (!SHA1_Init(&sha))
-        throw std::runtime_error("SHA1_Init");
-    if (!secret_key.empty()) {
-        if (!SHA1_Update(&sha, secret_key.data(), secret_key.length()))
-            throw std::runtime_error("SHA1_Update");
+    return entries[i];
+}
+
+void NeighborTable::erase(const in_addr &addr) {
+    auto neighbor = find(addr);
+    if (!neighbor)
+        return;
+    if (neighbor != &entries.back())
+        *neighbor = std::move(entries.back());
+    entries.pop_back();
+    rebuild();
+}
+
+void NeighborTable::clear() {
+    entries.clear();
+    slots.clear();
+    slot_bits = 0;
+    by_iface.clear();
+}
+
+const std::vector<uint32_t> &NeighborTable::on_iface(IfaceIndex iface) const {
+    static const std::vector<uint32_t> none;
+    return iface < by_iface.size() ? by_iface[iface] : none;
+}
+
+std::vector<in_addr> broadcast(int fd, const std::vector<NodePtr> &tree, NeighborTable &neighbors, const std::vector<in_addr> &probes,
+                               const std::vector<Iface> &ifaces) {
+    TraceSpan span("broadcast", nullptr, neighbors.size());
+    static uint32_t broadcasts = 0;
+    encode_tree(tree);
+    bool refresh = broadcasts++ % full_tree_every == 0;
+    uint8_t full_packet[65536], keepalive[header_len];
+    auto full_len = make_packet(full_packet, PacketKind::Full, seqno);
+    make_packet(keepalive, PacketKind::Keepalive, seqno);
+    seqno++;
+
+    // returns false if there's nobody at the address
+    auto send = [&](const in_addr &addr, bool full) {
+        return full ? send_packet(fd, addr, full_packet, full_len) : send_packet(fd, addr, keepalive, header_len);
+    };
+    std::vector<in_addr> to_delete;
+    for (auto &neighbor: neighbors) {
+        if (ifaces[neighbor.iface].multicast)
+            continue;
+        bool full = refresh || neighbor.sent_tree_version != ours.version;
+        if (!send(neighbor.addr, full))
+            to_delete.push_back(neighbor.addr);
+        else if (full)
+            neighbor.sent_tree_version = ours.version;
     }
-    if (!SHA1_Update(&sha, &buffer[SHA_DIGEST_LENGTH], len - SHA_DIGEST_LENGTH))
-        throw std::runtime_error("SHA1_Update");
+    for (IfaceIndex i = 0; i < ifaces.size(); i++) {
+        if (!ifaces[i].multicast)
+            continue;
+        multicast_on(fd, ifaces[i]);
+        // one packet for all of them, so full if any of them needs it
+        auto &on_iface = neighbors.on_iface(i);
+        bool full = refresh || std::any_of(on_iface.begin(), on_iface.end(), [&](uint32_t n) {
+            return neighbors[n].sent_tree_version != ours.version;
+        });
+        if (send(multicast_group, full) && full)
+            for (auto n: on_iface)
+                neighbors[n].sent_tree_version = ours.version;
+    }
+    for (auto &addr: probes)
+        send(addr, true);
+    for (auto &addr: to_delete)
+        neighbors.erase(addr);
+    return to_delete;
+}
+
+bool all_sent(const NeighborTable &neighbors, const std::vector<NodePtr> &tree) {
+    encode_tree(tree);
+    return std::all_of(neighbors.begin(), neighbors.end(), [](const Neighbor &neighbor) {
+        return neighbor.sent_tree_version == ours.version;
+    });
+}
+
+void solicit(int fd, const std::vector<in_addr> &addrs, const std::vector<Iface> &ifaces, bool multicast) {
+    TraceSpan span("solicit", nullptr, addrs.size());
+    uint8_t packet[header_len];
+    // the last broadcast's sequence number, as this isn't one
+    make_packet(packet, PacketKind::Solicit, seqno - 1);
+    for (auto &addr: addrs)
+        send_packet(fd, addr, packet, header_len);
+    if (!multicast)
+        return;
+    for (auto &iface: ifaces) {
+        if (!iface.multicast)
+            continue;
+        multicast_on(fd, iface);
+        send_packet(fd, multicast_group, packet, header_len);
+    }
+}
+
+bool answer_solicitation(int fd, Neighbor &neighbor, const std::vector<NodePtr> &tree) {
+    auto now = Clock::now();
+    if (now - neighbor.answered < solicit_holddown)
+        return false;
+    neighbor.answered = now;
+    encode_tree(tree);
+    uint8_t packet[65536];
+    auto len = make_packet(packet, PacketKind::Reply, seqno - 1);
+    if (!send_packet(fd, neighbor.addr, packet, len))
+        return false;
+    neighbor.sent_tree_version = ours.version;
+    return true;
+}
+
+void capture_packet(const uint8_t *buffer, size_t len, const in_addr &addr) {
+    if (len <= header_len)
+        return;
+    PacketHeader header;
+    memcpy(&header, &buffer[SHA_DIGEST_LENGTH], sizeof(header));
+    auto kind = static_cast<PacketKind>(ntohl(header.kind));
+    if (kind != PacketKind::Full && kind != PacketKind::Reply)
+        return;
+    std::ofstream ofs("/tmp/packet-" + show(addr));
+    ofs.write((const char *)buffer, len);
+}
+
+Packet decode_packet(const uint8_t *buffer, ssize_t len, const in_addr &addr, const timeval &received, const std::string &key) {
+    TraceSpan span("decode_packet", nullptr, len);
+    if (len < static_cast<ssize_t>(header_len))
+        throw std::runtime_error("Short packet from " + show(addr));
+
+    PacketHeader header;
+    memcpy(&header, &buffer[SHA_DIGEST_LENGTH], sizeof(header));
+    if (ntohl(header.version) != packet_version)
+        throw std::runtime_error(std::string("Unsupported packet version ") + std::to_string(ntohl(header.version)) +
+                                 " from " + show(addr));
     unsigned char md[SHA_DIGEST_LENGTH];
-    if (!SHA1_Final(md, &sha))
-        throw std::runtime_error("SHA1_Final");
+    sign(key, header, md);
     if (memcmp(&buffer[0], &md[0], SHA_DIGEST_LENGTH))
-        throw std::runtime_error(std::string("Invalid signature on packet from ") + inet_ntoa(addr));
-    
-    // timestamp at buffer[SHA_DIGEST_LENGTH]. currently unused.
-    neighbor.tree = deserialize(&buffer[SHA_DIGEST_LENGTH + sizeof(time_t)], len - SHA_DIGEST_LENGTH - sizeof(time_t));
-    neighbor.tree->addr = addr;
-    neighbor.last_seen = time(nullptr);
+        throw std::runtime_error("Invalid signature on packet from " + show(addr));
+
+    Packet res;
+    res.addr = addr;
+    res.received = received;
+    res.seqno = ntohl(header.seqno);
+    res.sent.tv_sec = ntohl(header.timestamp_sec);
+    res.sent.tv_usec = ntohl(header.timestamp_usec);
+    res.tree_version = ntohl(header.tree_version);
+    memcpy(res.tree_digest.data(), header.tree_digest, res.tree_digest.size());
+    res.kind = static_cast<PacketKind>(ntohl(header.kind));
+    switch (res.kind) {
+    case PacketKind::Keepalive:
+    case PacketKind::Solicit:
+        if (len != static_cast<ssize_t>(header_len))
+            throw std::runtime_error("Tree in a packet that shouldn't have one from " + show(addr));
+        break;
+    case PacketKind::Full:
+    case PacketKind::Reply: {
+        auto body = &buffer[header_len];
+        auto body_len = len - header_len;
+        SHA1(body, body_len, md);
+        if (memcmp(header.tree_digest, &md[0], SHA_DIGEST_LENGTH))
+            throw std::runtime_error("Tree doesn't match its digest in packet from " + show(addr));
+        res.tree = deserialize(body, body_len);
+        res.tree->addr = addr;
+        break;
+    }
+    default:
+        throw std::runtime_error("Unknown kind of packet from " + show(addr));
+    }
+    return res;
 }
 
-void nuke_trees_for_iface(NeighborSet &neighbors, const std::string &iface) {
-    for (auto &neighbor: neighbors)
-        if (neighbor.iface == iface)
-            neighbor.tree.reset();
+bool apply_packet(NeighborTable &neighbors, Packet &&packet, std::optional<IfaceIndex> candidate_iface) {
+    auto found = neighbors.find(packet.addr);
+    if (!found) {
+        if (!candidate_iface)
+            throw std::runtime_error("Packet from unknown neighbor " + show(packet.addr));
+        Neighbor n;
+        n.iface = *candidate_iface;
+        n.addr = packet.addr;
+        n.last_seen = time(nullptr);
+        found = &neighbors.insert(std::move(n));
+    }
+    auto &neighbor = *found;
+    bool changed = false;
+    if (packet.tree) {
+        changed = !neighbor.tree || *neighbor.tree != *packet.tree;
+        if (changed)
+            neighbor.tree = std::make_shared<const Node>(std::move(*packet.tree));
+        neighbor.tree_digest = packet.tree_digest;
+        neighbor.last_seen = time(nullptr);
+    } else if (neighbor.tree && neighbor.tree_digest == packet.tree_digest)
+        neighbor.last_seen = time(nullptr);
+    if (packet.kind == PacketKind::Solicit || packet.kind == PacketKind::Reply)
+        return changed;
+
+    auto seqno = packet.seqno;
+    int64_t delay = (static_cast<int64_t>(packet.received.tv_sec) - packet.sent.tv_sec) * 1000 +
+                    (static_cast<int64_t>(packet.received.tv_usec) - packet.sent.tv_usec) / 1000;
+    auto &link = neighbor.link;
+    if (!link.seen) {
+        link.seen = true;
+        link.base_delay = delay;
+    } else {
+        // a sequence number that went backwards or jumped ahead means the neighbor restarted
+        if (seqno > link.last_seqno && seqno - link.last_seqno - 1 <= max_counted_loss)
+            for (auto lost = seqno - link.last_seqno - 1; lost > 0; lost--)
+                link.delivery *= 1 - link_alpha;
+        if (delay < link.base_delay)
+            link.base_delay = delay;
+        else
+            link.base_delay += (delay - link.base_delay) / base_delay_creep;
+    }
+    link.last_seqno = seqno;
+    link.delivery = link.delivery * (1 - link_alpha) + link_alpha;
+    link.excess_delay = link.excess_delay * (1 - link_alpha) + (delay - link.base_delay) * link_alpha;
+    auto measured = measured_metric(link);
+    if (!link.metric || std::abs(measured - link.metric) >= std::max(metric_step, link.metric * metric_hysteresis))
+        link.metric = rounded_metric(measured);
+    return changed;
+}
+
+uint16_t link_metric(const Neighbor &neighbor) {
+    // restored from a snapshot and not heard from since
+    if (!neighbor.link.metric)
+        return rounded_metric(measured_metric(neighbor.link));
+    return neighbor.link.metric;
 }
 
-bool nuke_old_trees(NeighborSet &neighbors, int num_seconds) {
+void nuke_trees_for_iface(NeighborTable &neighbors, IfaceIndex iface) {
+    for (auto i: neighbors.on_iface(iface))
+        neighbors[i].tree.reset();
+}
+
+bool nuke_old_trees(NeighborTable &neighbors, int num_seconds) {
     bool res = false;
     auto now = time(nullptr);
     for (auto &neighbor: neighbors)
@@ -122,57 +459,109 @@ bool nuke_old_trees(NeighborSet &neighbors, int num_seconds) {
     return res;
 }
 
-std::pair<RouteSet, std::vector<Node>> derive_routes_and_mytree(const RouteSet &direct_nets, const NeighborSet &neighbors, const InAddrSet &default_gateways, const std::set<std::string> &zero_hop_ifaces) {
-    std::vector<Node> trees;
+std::vector<in_addr> drop_silent_neighbors(NeighborTable &neighbors, int num_seconds) {
+    std::vector<in_addr> res;
+    auto now = time(nullptr);
+    for (auto &neighbor: neighbors)
+        if (neighbor.last_seen < now - num_seconds)
+            res.push_back(neighbor.addr);
+    for (auto &addr: res)
+        neighbors.erase(addr);
+    return res;
+}
+
+/* Pick the gateways for the default route out of the given ones, which are
+   sorted on cost. See derive_routes_and_mytree(). */
+static NextHops select_default_gateways(const ScratchVector<GatewayPath> &gateways, const NextHops &current) {
+    NextHops res;
+    if (gateways.empty())
+        return res;
+    size_t wanted = std::min<size_t>(default_multipath, gateways.size());
+    auto limit = static_cast<uint64_t>(gateways[wanted - 1].cost) + gateway_margin;
+    for (auto &g: gateways) {
+        if (g.cost > limit || res.size() == wanted)
+            break;
+        if (current.contains(g.next_hop))
+            res.insert(g.next_hop);
+    }
+    for (auto &g: gateways) {
+        if (res.size() == wanted)
+            break;
+        res.insert(g.next_hop);
+    }
+    return res;
+}
+
+void derive_routes_and_mytree(const RouteSet &direct_nets, const NeighborTable &neighbors, const InAddrSet &default_gateways, const std::vector<bool> &zero_hop, Damping &damping, Arena &arena, Derived &derived) {
+    TraceSpan span("derive_routes_and_mytree", nullptr, neighbors.size());
+    ScratchVector<MergeRoot> trees { ArenaAllocator<MergeRoot>(arena) };
+    trees.reserve(neighbors.size());
     for (auto &neighbor: neighbors) {
         if (!neighbor.tree)
             continue;
-        // the top node here is actually still a placeholder. only the children are valid there.
-        Node n;
-        n.addr = neighbor.addr;
-        n.ethernet = zero_hop_ifaces.count(neighbor.iface);
-        n.gateway = default_gateways.count(neighbor.addr);
-        n.children = neighbor.tree->children;
-        trees.push_back(std::move(n));
+        // the top node of the tree is a placeholder. only the children are valid there.
+        MergeRoot root;
+        root.addr = neighbor.addr;
+        root.ethernet = neighbor.iface < zero_hop.size() && zero_hop[neighbor.iface];
+        root.gateway = default_gateways.count(neighbor.addr);
+        root.metric = root.ethernet ? 1 : link_metric(neighbor);
+        root.children = &neighbor.tree->children;
+        trees.push_back(root);
     }
 
-    auto [tree, routes, default_gateway] = merge(trees);
-    routes = aggregate(routes);
+    auto [host_routes, gateways] = merge(trees, derived.tree, arena);
+    damping.apply(host_routes, Clock::now());
+    damping.prune(derived.tree);
+
+    auto previous_default = derived.routes.find(route_key(in_addr { INADDR_ANY }, 0));
+    auto current_default = previous_default != derived.routes.end() ? derived.routes.gateways(previous_default.index()) : NextHops();
+    auto selected = select_default_gateways(gateways, current_default);
+    auto same_route = [](const Route &a, const Route &b) {
+        return a.addr.s_addr == b.addr.s_addr && a.netmask == b.netmask && a.gateways == b.gateways;
+    };
+    if (selected == current_default && direct_nets == derived.direct_nets &&
+        minimum_netmask == derived.minimum_netmask && optimal_aggregation == derived.optimal_aggregation &&
+        std::equal(host_routes.begin(), host_routes.end(), derived.host_routes.begin(), derived.host_routes.end(), same_route))
+        return;
+    derived.host_routes.assign(host_routes.begin(), host_routes.end());
+    derived.direct_nets = direct_nets;
+    derived.minimum_netmask = minimum_netmask;
+    derived.optimal_aggregation = optimal_aggregation;
+
+    RouteSet routes;
+    if (optimal_aggregation) {
+        routes = aggregate_optimal(host_routes, arena);
+        if (!same_forwarding(host_routes, routes)) {
+            syslog(LOG_ERR, "Optimal aggregation doesn't forward like the host routes, aggregating the usual way");
+            routes = aggregate(host_routes, arena);
+        }
+    } else routes = aggregate(host_routes, arena);
     
-    if (default_gateway.s_addr != INADDR_ANY) {
+    if (!selected.empty()) {
         Route default_route;
         default_route.addr.s_addr = INADDR_ANY;
         default_route.netmask = 0;
-        default_route.gateway = default_gateway;
+        default_route.gateways = selected;
         routes.insert(std::move(default_route));
     }
     
-    RouteSet to_erase;
-    for (auto &direct: direct_nets) {
-        for (auto &r: routes)
-            if (matches(direct, r.addr))
-                to_erase.insert(r);
-    }
-    if (!to_erase.empty()) {
-        RouteSet new_routes;
-        std::set_difference(routes.begin(), routes.end(), to_erase.begin(), to_erase.end(), std::inserter(new_routes, new_routes.begin()), RouteLess());
-        routes = std::move(new_routes);
-    }
-    
-    return { std::move(routes), std::move(tree.children) };
+    TraceSpan filter("filter direct nets", nullptr, routes.size());
+    RouteTrie direct(direct_nets);
+    routes.remove_if([&](const Route &route) { return direct.lookup(route.addr) != nullptr; });
+    derived.routes = std::move(routes);
 }
 
-bool check_reachable(const Neighbor &neighbor, Iface &iface) {
+bool check_reachable(Neighbor &neighbor, Iface &iface) {
     if (!neighbor.macaddr) {
-        auto arptable = get_arptable(neighbor.iface);
+        auto arptable = get_arptable(iface.name);
         auto it = arptable.find(neighbor.addr);
         if (it != arptable.end())
             neighbor.macaddr = it->second;
     }
     auto reachable = neighbor.macaddr && is_reachable(iface, *neighbor.macaddr);
-    if (!reachable) {
+    // last_seen is left alone: a neighbor that's unreachable for a while
+    // shouldn't be dropped as long as it keeps talking to us
+    if (!reachable)
         neighbor.tree.reset();
-        neighbor.last_seen = 0;
-    }
     return reachable;
 }
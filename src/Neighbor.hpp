@@ -1,60 +1,246 @@
 #ifndef NEIGHBOR_HPP
 #define NEIGHBOR_HPP
 
+#include <array>
+#include <memory>
 #include <string>
 #include <netinet/in.h>
 #include <optional>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <net/ethernet.h>
-#include <set>
+#include <openssl/sha.h>
 
+#include "Damping.hpp"
 #include "Route.hpp"
 #include "Tree.hpp"
 #include "Iface.hpp"
+#include "Scheduler.hpp"
+
+/* What we know about the quality of the link to a neighbor, estimated from
+   the sequence numbers and timestamps on the packets it sends us. */
+struct LinkStats {
+    bool seen = false;
+    uint32_t last_seqno = 0;
+    double delivery = 1.0;      // moving average of the fraction of packets that arrive
+    int64_t base_delay = 0;     // lowest one-way delay in ms, clock offset included
+    double excess_delay = 0;    // moving average of the delay on top of that, in ms
+    uint16_t metric = 0;        // as last put in the tree, see link_metric()
+};
+
+/* The SHA1 of a tree as it goes over the wire, which is what keepalives
+   carry instead of the tree. */
+using TreeDigest = std::array<uint8_t, SHA_DIGEST_LENGTH>;
 
 struct Neighbor {
-    std::string iface;
+    IfaceIndex iface;
     in_addr addr;
-    mutable std::optional<ether_addr> macaddr;
-    mutable int last_seen;
-    int seqno;
-    mutable std::optional<Node> tree;
+    std::optional<ether_addr> macaddr;
+    int last_seen;
+    LinkStats link;
+    /* Immutable once received, so that a snapshot of the neighbors can share
+       the trees with the main loop instead of copying them. */
+    std::shared_ptr<const Node> tree;
+    TreeDigest tree_digest {};      // of the tree above, for keepalives to be checked against
+    uint32_t sent_tree_version = 0; // the version of our tree last sent to it in full
+    Clock::time_point answered {};  // when we last answered a solicitation from it
+    Clock::time_point solicited {}; // when we last asked it for its tree
+};
+
+/* The neighbors, stored one after the other in a vector. An open addressing
+   hash on the address finds the neighbor for a packet without allocating
+   anything, and a list of entries per interface saves going over all of
+   them for things that concern a single interface. Iteration is over the
+   vector, in the order the neighbors were added. */
+class NeighborTable {
+public:
+    using iterator = std::vector<Neighbor>::iterator;
+    using const_iterator = std::vector<Neighbor>::const_iterator;
+
+    Neighbor *find(const in_addr &);
+    const Neighbor *find(const in_addr &) const;
+
+    /* Add the given neighbor, unless there already is one with that
+       address. Returns the one in the table either way. */
+    Neighbor &insert(Neighbor);
+
+    /* Removing a neighbor reshuffles the entries and rebuilds the indices,
+       which is fine because it's rare. */
+    void erase(const in_addr &);
+    void clear();
+
+    /* The indices of the neighbors on the given interface. */
+    const std::vector<uint32_t> &on_iface(IfaceIndex) const;
+
+    Neighbor &operator[](size_t i) { return entries[i]; }
+    const Neighbor &operator[](size_t i) const { return entries[i]; }
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+private:
+    /* The slot the given address is in, or the empty one where it would go. */
+    size_t slot_for(in_addr_t) const;
+    void rebuild();
+
+    std::vector<Neighbor> entries;
+    std::vector<uint32_t> slots; // index into entries plus one, 0 for an empty slot
+    int slot_bits = 0;
+    std::vector<std::vector<uint32_t>> by_iface;
+};
+
+// TODO: broadcast() and decode_packet() are lopsided. broadcat() allocates a buffer and decode_packet() takes an already allocated one
+
+/* Broadcast the given list of tree nodes to the given table of neighbors over
+   the given file descriptor, and send the same packet to the given addresses
+   to probe them. On the interfaces that are marked for multicast, a single
+   packet to multicast_group replaces the ones to the neighbors there.
+   Neighbors that can't be sent to are removed from the table and returned.
+
+   The tree is only encoded and hashed when it changes, which bumps its
+   version. A neighbor that was sent the current version in full gets a
+   keepalive instead: a packet with just the digest and the version of the
+   tree. Every full_tree_every broadcasts, everybody gets the full tree, so
+   that a neighbor that missed it doesn't have to wait for the next change.
+   Probes always carry the full tree. */
+std::vector<in_addr> broadcast(int fd, const std::vector<NodePtr> &tree, NeighborTable &, const std::vector<in_addr> &probes,
+                               const std::vector<Iface> &);
+
+/* Has every neighbor been sent the given tree in full? Until then, the
+   broadcast that would send it isn't to be skipped. */
+bool all_sent(const NeighborTable &, const std::vector<NodePtr> &tree);
+
+/* Ask the given addresses for their trees right away. If multicast is set,
+   also ask everybody on the interfaces marked for multicast, with a packet
+   to multicast_group on each. Used at startup and when a neighbor comes
+   back, so that we don't have to wait for their next broadcasts. */
+void solicit(int fd, const std::vector<in_addr> &, const std::vector<Iface> &, bool multicast);
+
+/* A neighbor gets at most one answer to its solicitations this often, and
+   at most one solicitation for a tree we missed. */
+constexpr auto solicit_holddown = std::chrono::seconds(1);
+
+/* Send the given tree to the given neighbor alone, in answer to a
+   solicitation from it. Returns whether it was sent, which it isn't if the
+   neighbor was answered less than solicit_holddown ago. */
+bool answer_solicitation(int fd, Neighbor &, const std::vector<NodePtr> &tree);
+
+/* What a packet is for. Full packets and keepalives are broadcasts. A
+   solicitation asks for the tree, and a reply is a tree sent in answer.
+   Those two carry the sequence number of the last broadcast and leave the
+   link statistics alone. */
+enum class PacketKind : uint32_t {
+    Full,
+    Keepalive,
+    Solicit,
+    Reply,
 };
 
-struct NeighborLess {
-    bool operator()(const Neighbor &one, const Neighbor &other) const {
-        return one.addr.s_addr < other.addr.s_addr;
-    }
+/* A packet from a neighbor, with its signature checked and its tree
+   decoded, but not taken in yet. */
+struct Packet {
+    in_addr addr;      // where it came from
+    timeval received;  // when it came in
+    PacketKind kind;
+    uint32_t seqno;
+    timeval sent;      // the sender's timestamp
+    uint32_t tree_version;
+    TreeDigest tree_digest;
+    std::optional<Node> tree; // only in a full packet or a reply
 };
-using NeighborSet = std::set<Neighbor, NeighborLess>;
 
-// TODO: broadcast() and handle_data() are lopsided. broadcat() allocates a buffer and handle_data() takes an already allocated one
+/* Save the given packet from the given address to /tmp/packet-<addr>, for
+   lvrouted-replay, if it carries a tree. Keepalives and solicitations are
+   left out, so that what's there is the last tree the neighbor sent. The
+   write is synchronous, so the daemon only calls this with capture_packets
+   on. */
+void capture_packet(const uint8_t *, size_t, const in_addr &);
 
-/* Broadcast the given list of tree nodes to the given Set of neighbors over
-   the given file descriptor. */
-void broadcast(int fd, const std::vector<Node> &tree, NeighborSet &);
+/* Check the signature and version of the given packet, received from the
+   given address at the given time, against the given key, and decode the
+   tree in it, if it has one. Throws a runtime_error if there's
+   anything wrong with it. This only uses the intern pool of deserialize(),
+   so it can run on any thread. */
+Packet decode_packet(const uint8_t *, ssize_t, const in_addr &, const timeval &received, const std::string &key);
 
-/* Given a set of neighbors, data in a string and the sockaddr it came from,
-   handle it. Verify the signature, find the neighbor associated with the
-   address, verify the sequence number, parse the tree and mark the time. */
-void handle_data(NeighborSet &, const uint8_t *, ssize_t, const in_addr &);
+/* Take in a decoded packet: find the neighbor it came from, update the link
+   statistics from the sequence number and timestamp, store the tree and
+   mark the time. If there's no neighbor with the address yet but there
+   could be one on the given interface, the packet's signature is enough to
+   add it. A packet without a tree only counts as hearing from the neighbor
+   if it's about the tree we have from it. Otherwise the tree goes stale
+   until the full one comes in, which it's up to the caller to solicit.
+   Returns whether the neighbor's tree is any different from what it was. */
+bool apply_packet(NeighborTable &, Packet &&, std::optional<IfaceIndex>);
+
+/* The metric for the link to the given neighbor, as put in the tree. This is
+   ten times the expected transmission count (ETX) of the link, which assumes
+   the link loses as many packets going out as it does coming in, plus a
+   point for every 10 ms the neighbor's packets are delayed over the lowest
+   delay seen. Never less than 10 and capped at 65535. It goes in steps of
+   5, and stays where it is until the measurement has moved a step or 10%
+   away from it, so that the tree doesn't change with every bit of jitter. */
+uint16_t link_metric(const Neighbor &);
 
 /* Given a list of neighbors and interface i, invalidate the trees
    for all the neighbors on that interface */
-void nuke_trees_for_iface(NeighborSet &, const std::string &);
+void nuke_trees_for_iface(NeighborTable &, IfaceIndex);
 
 /* Given a list of neighbors and a number of seconds, invalidate the 
    trees of all neighbors not heard from since numsecs ago */
-bool nuke_old_trees(NeighborSet &, int num_seconds);
+bool nuke_old_trees(NeighborTable &, int num_seconds);
+
+/* Remove the neighbors not heard from since num_seconds ago from the table,
+   and return their addresses. */
+std::vector<in_addr> drop_silent_neighbors(NeighborTable &, int num_seconds);
+
+/* What derive_routes_and_mytree() carries from one run to the next: the
+   routes and the tree the previous run came up with, and what the routes
+   were derived from besides the neighbor trees. Start with one that's
+   empty. */
+struct Derived {
+    RouteSet routes;
+    std::vector<NodePtr> tree;
+    std::vector<Route> host_routes; // after damping
+    RouteSet direct_nets;
+    int minimum_netmask = 0;
+    bool optimal_aggregation = false;
+};
 
 /* From the given set of direct IPs, a list of neighbors, a list of default
-   gateways on the network to look out for (and indeed insert a default route
-   for the nearest of these) plus a set of interfaces that count as zero-hop
-   links, derive a list of (unaggregated) routes and a merged tree. */
-std::pair<RouteSet, std::vector<Node>> derive_routes_and_mytree(const RouteSet &, const NeighborSet &, const InAddrSet &, const std::set<std::string> &);
+   gateways on the network to look out for plus a flag per interface index
+   that says whether it counts as a zero-hop link, derive a list of
+   (aggregated) routes and a merged tree. Scratch data goes in the given
+   arena.
+
+   The results go in the given Derived, which holds those of the previous
+   run going in. The tree is only built where it changed, see merge(), and
+   the routes are only aggregated again if the host routes, the direct nets,
+   the default route or the aggregation settings changed. A run that comes
+   up with the same as the previous one leaves them as they were and, once
+   the arena and the damping have grown to size, allocates nothing.
+
+   Route flaps are damped per destination, on the host routes that come out
+   of the merge, by the given Damping. That's before they're aggregated, so
+   that a flapping destination doesn't take the prefix it would be
+   aggregated into along with it. Suppressed destinations are left out of
+   the merged tree too, so that neighbors don't see them flap either.
+
+   The gateways are those neighbors plus the nodes that advertise
+   themselves as gateways. The default route goes through the next hops
+   toward them, each counted at the cost of the nearest gateway behind it:
+   the default_multipath nearest next hops, as one multipath route if
+   there's more than one. The next hops of the previous run's default route
+   are kept as long as they're within gateway_margin of the cost of the
+   farthest one that would otherwise be picked, so that gateways at about
+   the same distance don't take turns. */
+void derive_routes_and_mytree(const RouteSet &, const NeighborTable &, const InAddrSet &, const std::vector<bool> &, Damping &, Arena &, Derived &);
 
 /* Check if the given neighbor is reachable over the given Iface.t. If it
    isn't, set the neighbor's tree to None. */
-bool check_reachable(const Neighbor &, Iface &);
+bool check_reachable(Neighbor &, Iface &);
 
 #endif // NEIGHBOR_HPP
@@ -1,6 +1,8 @@
 #include "Route.hpp"
+#include "Trace.hpp"
 
 #include <algorithm>
+#include <map>
 #include <arpa/inet.h>
 #include <sstream>
 #include <vector>
@@ -12,6 +14,49 @@
 #include <cstring>
 #include <cstddef>
 
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+bool NextHops::insert(in_addr gateway, int limit) {
+    auto pos = std::lower_bound(&addrs[0], &addrs[count], gateway, InAddrLess());
+    if (pos != &addrs[count] && pos->s_addr == gateway.s_addr)
+        return false; // already in there
+    if (count >= limit) {
+        if (pos == &addrs[count])
+            return false; // higher than everything we already have
+        --count;
+    }
+    std::copy_backward(pos, &addrs[count], &addrs[count + 1]);
+    *pos = gateway;
+    ++count;
+    return true;
+}
+
+bool NextHops::erase(in_addr gateway) {
+    auto pos = std::lower_bound(&addrs[0], &addrs[count], gateway, InAddrLess());
+    if (pos == &addrs[count] || pos->s_addr != gateway.s_addr)
+        return false;
+    std::copy(pos + 1, &addrs[count], pos);
+    --count;
+    return true;
+}
+
+bool NextHops::contains(in_addr gateway) const {
+    return std::find_if(begin(), end(), [&](const in_addr &a) {
+        return a.s_addr == gateway.s_addr;
+    }) != end();
+}
+
+bool NextHops::operator==(const NextHops &other) const {
+    return count == other.count &&
+           std::equal(begin(), end(), other.begin(), [](const in_addr &a, const in_addr &b) {
+               return a.s_addr == b.s_addr;
+           });
+}
+
 bool includes(const Route &a, const Route &b) {
     if (a.netmask > b.netmask)
         return false;
@@ -24,99 +69,454 @@ bool matches(const Route &route, const in_addr &addr) {
     return (route.addr.s_addr & m) == (addr.s_addr & m);
 }
 
+RouteSet::RouteSet(std::vector<Route> routes) {
+    std::stable_sort(routes.begin(), routes.end(), [](const Route &a, const Route &b) {
+        return route_key(a) < route_key(b);
+    });
+    reserve(routes.size());
+    for (auto &route: routes) {
+        auto key = route_key(route);
+        if (keys_.empty() || keys_.back() != key)
+            push_back(key, route.gateways);
+    }
+}
+
+bool RouteSet::insert(const Route &route) {
+    auto key = route_key(route);
+    if (keys_.empty() || keys_.back() < key) {
+        push_back(key, route.gateways);
+        return true;
+    }
+    auto pos = std::lower_bound(keys_.begin(), keys_.end(), key);
+    if (*pos == key)
+        return false;
+    gateways_.insert(gateways_.begin() + (pos - keys_.begin()), route.gateways);
+    keys_.insert(pos, key);
+    return true;
+}
+
+RouteSet::const_iterator RouteSet::find(RouteKey key) const {
+    auto pos = std::lower_bound(keys_.begin(), keys_.end(), key);
+    if (pos == keys_.end() || *pos != key)
+        return end();
+    return const_iterator(this, pos - keys_.begin());
+}
+
+RouteSet::const_iterator RouteSet::erase(const_iterator it) {
+    keys_.erase(keys_.begin() + it.index());
+    gateways_.erase(gateways_.begin() + it.index());
+    return it;
+}
+
+RouteTrie::RouteTrie(const RouteSet &set) {
+    // at most a node per bit of every netmask, plus the root
+    size_t bits = 0;
+    for (const auto &route: set)
+        bits += route.netmask;
+    nodes.reserve(bits + 1);
+    routes.reserve(set.size());
+    for (const auto &route: set)
+        insert(route);
+}
+
+void RouteTrie::insert(const Route &route) {
+    if (nodes.empty())
+        nodes.emplace_back();
+    int32_t n = 0;
+    for (int bit = 0; bit < route.netmask; bit++) {
+        auto b = (route.addr.s_addr >> (31 - bit)) & 1;
+        if (nodes[n].child[b] == -1) {
+            nodes[n].child[b] = nodes.size();
+            nodes.emplace_back();
+        }
+        n = nodes[n].child[b];
+    }
+    if (nodes[n].route == -1) {
+        nodes[n].route = routes.size();
+        routes.push_back(route);
+    } else routes[nodes[n].route] = route;
+}
+
+const Route *RouteTrie::lookup(const in_addr &addr) const {
+    if (nodes.empty())
+        return nullptr;
+    int32_t best = nodes[0].route;
+    int32_t n = 0;
+    for (int bit = 0; bit < 32; bit++) {
+        n = nodes[n].child[(addr.s_addr >> (31 - bit)) & 1];
+        if (n == -1)
+            break;
+        if (nodes[n].route != -1)
+            best = nodes[n].route;
+    }
+    return best == -1 ? nullptr : &routes[best];
+}
+
 std::string show(const Route &route) {
-    in_addr a { htonl(route.addr.s_addr) };
-    in_addr b { htonl(route.gateway.s_addr) };
-    return std::string(inet_ntoa(a)) + "/" + std::to_string(route.netmask) + " -> " + std::string(inet_ntoa(b));
+    auto res = show(route.addr) + "/" + std::to_string(route.netmask) + " ->";
+    for (auto &gw: route.gateways)
+        res += " " + show(gw);
+    return res;
 }
 
 std::string show(const RouteSet &routes) {
     std::ostringstream oss;
     oss << "Route table:" << std::endl;
-    for (auto &route: routes)
+    for (const auto &route: routes)
          oss << "\t" << show(route) << std::endl;
     return oss.str();
 }
 
-RouteSet aggregate(const RouteSet &rs) {
-    RouteSet res;
+// host routes to the gateway itself, which neither kind of aggregation keeps
+static bool route_to_gateway_itself(const Route &route) {
+    return route.netmask == 32 && route.gateways.size() == 1 &&
+           route.gateways.front().s_addr == route.addr.s_addr;
+}
 
-    std::vector<Route> routes(rs.begin(), rs.end());
-    for (size_t i = 0; i < routes.size(); ) {
-        auto &route = routes[i];
-        if (route.netmask == minimum_netmask) {
-            res.insert(std::move(route));
-            routes.erase(routes.begin() + i);
-            continue;
-        }
-        if (route.addr.s_addr == route.gateway.s_addr && route.netmask == 32) {
-            routes.erase(routes.begin() + i);
-            continue;
-        }
+RouteSet aggregate(const ScratchVector<Route> &rs, Arena &arena) {
+    TraceSpan span("aggregate", nullptr, rs.size());
+    std::vector<Route> res;
+    res.reserve(rs.size()); // never more routes than went in
+
+    ScratchVector<Route> routes { ArenaAllocator<Route>(arena) };
+    routes.reserve(rs.size());
+    for (auto &route: rs)
+        if (!route_to_gateway_itself(route))
+            routes.push_back(route);
 
+    ScratchVector<bool> done(routes.size(), false, ArenaAllocator<bool>(arena));
+    for (size_t i = 0; i < routes.size(); i++) {
+        if (done[i])
+            continue;
+        auto route = routes[i];
         while (route.netmask > minimum_netmask) {
-            --route.netmask;
-            size_t j;
-            for (j = i + 1; j < routes.size(); j++) {
-                auto &other_route = routes[j];
-                if (route.gateway.s_addr != other_route.addr.s_addr && includes(route, other_route))
-                    break;
-            }
-            if (j < routes.size()) {
-                ++route.netmask;
-                res.insert(std::move(route));
-                routes.erase(routes.begin() + i);
+            auto expanded = route;
+            --expanded.netmask;
+            expanded.addr.s_addr &= bitmask(expanded.netmask);
+            auto gobbles = std::find_if(routes.begin(), routes.end(), [&](const Route &other) {
+                return other.gateways != route.gateways && includes(expanded, other);
+            });
+            if (gobbles != routes.end())
                 break;
+            route = expanded;
+        }
+        route.addr.s_addr &= bitmask(route.netmask);
+        for (size_t j = i + 1; j < routes.size(); j++)
+            if (routes[j].gateways == route.gateways && includes(route, routes[j]))
+                done[j] = true;
+        res.push_back(route);
+    }
+    return RouteSet(std::move(res));
+}
+
+/* The trie aggregate_optimal() works on. Nodes are where the trie branches,
+   and the host routes; the gateway sets are numbered, and called labels.
+   cost(v, h) is the fewest routes the subtree under v needs when a route to
+   h covers it from above. It only depends on whether h is one of the labels
+   in the subtree, so a node keeps it for those, sorted on label, and once
+   for all the others. */
+struct OrtcTrie {
+    static constexpr uint32_t no_label = UINT32_MAX;
+    static constexpr uint32_t impossible = UINT32_MAX / 4;
+
+    struct TrieNode {
+        in_addr_t addr;
+        int depth;             // the bit it branches on, 32 for a host route
+        int32_t child[2];      // -1 for a host route
+        uint32_t label;        // of a host route
+        size_t table, table_len; // into costs
+        uint32_t other;        // cost(v, h) for the labels not in the table
+        uint32_t best;         // fewest routes under v with one right at v, not counting that one
+        uint32_t best_label;   // what that one goes to
+    };
+
+    explicit OrtcTrie(Arena &arena)
+        : nodes(ArenaAllocator<TrieNode>(arena)), costs(ArenaAllocator<std::pair<uint32_t, uint32_t>>(arena)) { }
+
+    uint32_t cost(int32_t v, uint32_t h) const {
+        auto begin = costs.begin() + nodes[v].table, end = begin + nodes[v].table_len;
+        auto it = std::lower_bound(begin, end, std::make_pair(h, uint32_t(0)));
+        return it != end && it->first == h ? it->second : nodes[v].other;
+    }
+
+    // cost(v, h) without a route at v itself
+    uint32_t pass_down(int32_t v, uint32_t h) const {
+        auto &n = nodes[v];
+        if (n.child[0] == -1)
+            return h == n.label ? 0 : impossible;
+        return cost(n.child[0], h) + cost(n.child[1], h);
+    }
+
+    // build the trie for the given host routes, which share at least the first depth bits
+    int32_t build(const Route *routes, const uint32_t *labels, size_t count) {
+        TrieNode n;
+        if (count == 1) {
+            n = { routes[0].addr.s_addr, 32, { -1, -1 }, labels[0], costs.size(), 1, 1, 0, labels[0] };
+            costs.emplace_back(labels[0], 0);
+            nodes.push_back(n);
+            return nodes.size() - 1;
+        }
+        auto depth = __builtin_clz(routes[0].addr.s_addr ^ routes[count - 1].addr.s_addr);
+        auto bit = in_addr_t(1) << (31 - depth);
+        auto split = std::partition_point(routes, routes + count, [bit](const Route &r) {
+            return (r.addr.s_addr & bit) == 0;
+        }) - routes;
+        auto left = build(routes, labels, split);
+        auto right = build(routes + split, labels + split, count - split);
+
+        n = { routes[0].addr.s_addr & bitmask(depth), depth, { left, right }, no_label, costs.size(), 0, 0, impossible, no_label };
+        auto &l = nodes[left], &r = nodes[right];
+        size_t i = l.table, i_end = l.table + l.table_len;
+        size_t j = r.table, j_end = r.table + r.table_len;
+        while (i < i_end || j < j_end) {
+            uint32_t h, c;
+            if (j == j_end || (i < i_end && costs[i].first < costs[j].first)) {
+                h = costs[i].first;
+                c = costs[i++].second + r.other;
+            } else if (i == i_end || costs[j].first < costs[i].first) {
+                h = costs[j].first;
+                c = l.other + costs[j++].second;
+            } else {
+                h = costs[i].first;
+                c = costs[i++].second + costs[j++].second;
             }
-            for (size_t j = routes.size() - 1; j > i + 1; j--) {
-                auto &other_route = routes[j];
-                if (includes(route, other_route)) {
-                    routes.erase(routes.begin() + j);
-                }
+            costs.emplace_back(h, c);
+            if (c < n.best) {
+                n.best = c;
+                n.best_label = h;
             }
         }
-        if (route.netmask == 32) {
-            routes.erase(routes.begin() + i);
-            continue;
+        n.table_len = costs.size() - n.table;
+        for (size_t k = n.table; k < costs.size(); k++)
+            costs[k].second = std::min(costs[k].second, n.best + 1);
+        n.other = std::min(l.other + r.other, n.best + 1);
+        nodes.push_back(n);
+        return nodes.size() - 1;
+    }
+
+    /* Put down the routes for the subtree under v, whose branch-free stretch
+       starts at the given netmask, when it's covered by a route to h. */
+    void emit(int32_t v, int netmask, uint32_t h, const ScratchVector<NextHops> &gateways, std::vector<Route> &out) const {
+        auto &n = nodes[v];
+        if (n.best + 1 <= pass_down(v, h)) {
+            Route route;
+            route.addr.s_addr = n.addr & bitmask(netmask);
+            route.netmask = netmask;
+            route.gateways = gateways[n.best_label];
+            out.push_back(route);
+            h = n.best_label;
         }
-        i++;
+        if (n.child[0] == -1)
+            return;
+        emit(n.child[0], n.depth + 1, h, gateways, out);
+        emit(n.child[1], n.depth + 1, h, gateways, out);
     }
-    return res;
+
+    ScratchVector<TrieNode> nodes;
+    ScratchVector<std::pair<uint32_t, uint32_t>> costs;
+};
+
+RouteSet aggregate_optimal(const ScratchVector<Route> &rs, Arena &arena) {
+    TraceSpan span("aggregate_optimal", nullptr, rs.size());
+    ScratchVector<Route> routes { ArenaAllocator<Route>(arena) };
+    routes.reserve(rs.size());
+    for (auto &route: rs)
+        if (!route_to_gateway_itself(route))
+            routes.push_back(route);
+    std::sort(routes.begin(), routes.end(), [](const Route &a, const Route &b) {
+        return a.addr.s_addr < b.addr.s_addr;
+    });
+
+    // number the gateway sets
+    auto less = [](const NextHops &a, const NextHops &b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), InAddrLess());
+    };
+    using LabelAllocator = ArenaAllocator<std::pair<const NextHops, uint32_t>>;
+    std::map<NextHops, uint32_t, decltype(less), LabelAllocator> label_of(less, LabelAllocator(arena));
+    ScratchVector<NextHops> gateways { ArenaAllocator<NextHops>(arena) };
+    ScratchVector<uint32_t> labels { ArenaAllocator<uint32_t>(arena) };
+    labels.reserve(routes.size());
+    for (auto &route: routes) {
+        auto [it, added] = label_of.emplace(route.gateways, gateways.size());
+        if (added)
+            gateways.push_back(route.gateways);
+        labels.push_back(it->second);
+    }
+
+    // no route is shorter than minimum_netmask, so every block of that size is on its own
+    int min = minimum_netmask;
+    OrtcTrie trie(arena);
+    std::vector<Route> res;
+    res.reserve(routes.size()); // the host routes as they are would do, so the optimum is never more
+    for (size_t lo = 0, hi; lo < routes.size(); lo = hi) {
+        auto block = routes[lo].addr.s_addr & bitmask(min);
+        for (hi = lo + 1; hi < routes.size() && (routes[hi].addr.s_addr & bitmask(min)) == block; hi++)
+            ;
+        auto top = trie.build(&routes[lo], &labels[lo], hi - lo);
+        trie.emit(top, min, OrtcTrie::no_label, gateways, res);
+    }
+    return RouteSet(std::move(res));
 }
 
-std::tuple<RouteSet, RouteSet, RouteSet> diff(const RouteSet &old_routes, const RouteSet &new_routes) {
-    RouteSet deletes, adds, changes;
-    auto old_it = old_routes.begin();
-    auto new_it = new_routes.begin();
+bool same_forwarding(const ScratchVector<Route> &host_routes, const RouteSet &routes) {
+    for (const auto &route: routes)
+        if (route.netmask < minimum_netmask)
+            return false;
+    RouteTrie index(routes);
+    for (auto &host: host_routes) {
+        if (route_to_gateway_itself(host))
+            continue;
+        auto route = index.lookup(host.addr);
+        if (!route || route->gateways != host.gateways)
+            return false;
+    }
+    return true;
+}
 
-    RouteLess l;
+/* The kernels the set operations are built on. Both look at a vector of
+   keys at a time where the CPU has the instructions for it, and at one key
+   at a time otherwise. Keys are well below 2^63, so the signed 64 bit
+   compares of SSE4.2 and AVX2 order them right. */
+
+// How many keys at the start of a and b are the same, looking at n at most.
+static size_t equal_run(const RouteKey *a, const RouteKey *b, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 4 <= n; i += 4) {
+        auto eq = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+                                     _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        if (mask != 0xf)
+            return i + __builtin_ctz(~mask);
+    }
+#elif defined(__SSE4_2__)
+    for (; i + 2 <= n; i += 2) {
+        auto eq = _mm_cmpeq_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+        auto mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask != 0x3)
+            return i + __builtin_ctz(~mask);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 2 <= n; i += 2) {
+        auto eq = vceqq_u64(vld1q_u64(a + i), vld1q_u64(b + i));
+        if (vgetq_lane_u64(eq, 0) == 0)
+            return i;
+        if (vgetq_lane_u64(eq, 1) == 0)
+            return i + 1;
+    }
+#endif
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
 
-    while (true) {
-        if (old_it == old_routes.end()) {
-            std::copy(new_it, new_routes.end(), std::inserter(adds, adds.begin()));
-            break;
-        }
-        if (new_it == new_routes.end()) {
-            std::copy(old_it, old_routes.end(), std::inserter(deletes, deletes.begin()));
-            break;
+// How many keys at the start of a are below key, looking at n at most.
+static size_t below_run(const RouteKey *a, size_t n, RouteKey key) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    auto k = _mm256_set1_epi64x(static_cast<long long>(key));
+    for (; i + 4 <= n; i += 4) {
+        auto lt = _mm256_cmpgt_epi64(k, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)));
+        auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+        if (mask != 0xf)
+            return i + __builtin_ctz(~mask);
+    }
+#elif defined(__SSE4_2__)
+    auto k = _mm_set1_epi64x(static_cast<long long>(key));
+    for (; i + 2 <= n; i += 2) {
+        auto lt = _mm_cmpgt_epi64(k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+        auto mask = _mm_movemask_pd(_mm_castsi128_pd(lt));
+        if (mask != 0x3)
+            return i + __builtin_ctz(~mask);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    auto k = vdupq_n_u64(key);
+    for (; i + 2 <= n; i += 2) {
+        auto lt = vcltq_u64(vld1q_u64(a + i), k);
+        if (vgetq_lane_u64(lt, 0) == 0)
+            return i;
+        if (vgetq_lane_u64(lt, 1) == 0)
+            return i + 1;
+    }
+#endif
+    while (i < n && a[i] < key)
+        i++;
+    return i;
+}
+
+/* Merge the keys of a and b. Ranges of positions in a with keys that aren't
+   in b go to only_a(begin, end), and likewise for b. Runs of keys in both
+   go to both(position in a, position in b, length). */
+template<typename OnlyA, typename Both, typename OnlyB>
+static void merge_keys(const RouteSet &a, const RouteSet &b, OnlyA only_a, Both both, OnlyB only_b) {
+    auto ka = a.keys().data(), kb = b.keys().data();
+    size_t na = a.size(), nb = b.size();
+    size_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        if (auto n = equal_run(ka + i, kb + j, std::min(na - i, nb - j))) {
+            both(i, j, n);
+            i += n;
+            j += n;
+        } else if (ka[i] < kb[j]) {
+            n = below_run(ka + i, na - i, kb[j]);
+            only_a(i, i + n);
+            i += n;
+        } else {
+            n = below_run(kb + j, nb - j, ka[i]);
+            only_b(j, j + n);
+            j += n;
         }
-        if (l(*old_it, *new_it))
-            deletes.insert(*old_it);
-        else if (l(*new_it, *old_it))
-            adds.insert(*new_it);
-        else if (old_it->gateway.s_addr != new_it->gateway.s_addr)
-            changes.insert(*new_it);
-        ++old_it;
-        ++new_it;
     }
+    only_a(i, na);
+    only_b(j, nb);
+}
+
+static void copy_range(RouteSet &to, const RouteSet &from, size_t begin, size_t end) {
+    for (auto i = begin; i < end; i++)
+        to.push_back(from.key(i), from.gateways(i));
+}
+
+std::tuple<RouteSet, RouteSet, RouteSet> diff(const RouteSet &old_routes, const RouteSet &new_routes) {
+    TraceSpan span("diff", nullptr, new_routes.size());
+    RouteSet deletes, adds, changes;
+    merge_keys(old_routes, new_routes,
+        [&](size_t begin, size_t end) { copy_range(deletes, old_routes, begin, end); },
+        [&](size_t i, size_t j, size_t n) {
+            for (size_t k = 0; k < n; k++)
+                if (old_routes.gateways(i + k) != new_routes.gateways(j + k))
+                    changes.push_back(new_routes.key(j + k), new_routes.gateways(j + k));
+        },
+        [&](size_t begin, size_t end) { copy_range(adds, new_routes, begin, end); });
     return { std::move(deletes), std::move(adds), std::move(changes) };
 }
 
+RouteSet intersection(const RouteSet &a, const RouteSet &b) {
+    RouteSet res;
+    merge_keys(a, b,
+        [](size_t, size_t) { },
+        [&](size_t i, size_t, size_t n) { copy_range(res, a, i, i + n); },
+        [](size_t, size_t) { });
+    return res;
+}
+
+RouteSet difference(const RouteSet &a, const RouteSet &b) {
+    RouteSet res;
+    merge_keys(a, b,
+        [&](size_t begin, size_t end) { copy_range(res, a, begin, end); },
+        [&](size_t i, size_t j, size_t n) {
+            for (size_t k = 0; k < n; k++)
+                if (a.gateways(i + k) != b.gateways(j + k))
+                    res.push_back(a.key(i + k), a.gateways(i + k));
+        },
+        [](size_t, size_t) { });
+    return res;
+}
+
 #ifdef __FreeBSD__
-static size_t routemsg_add(uint8_t *buffer, int type, const Route &route) {
+size_t route_message(uint8_t *buffer, int type, const Route &route, const in_addr &gateway, int seq) {
 	struct rt_msghdr *msghdr;
 	struct sockaddr_in *addr;
-	static int seq = 1;
 
 	msghdr = (struct rt_msghdr *)buffer;	
 	memset(msghdr, 0, sizeof(struct rt_msghdr));
@@ -125,7 +525,7 @@ static size_t routemsg_add(uint8_t *buffer, int type, const Route &route) {
 	msghdr->rtm_addrs = RTA_DST | RTA_GATEWAY | RTA_NETMASK;
 	msghdr->rtm_pid = 0;
 	msghdr->rtm_flags = RTF_UP | RTF_GATEWAY | RTF_DYNAMIC;
-	msghdr->rtm_seq = seq++;
+	msghdr->rtm_seq = seq;
 
 	addr = (struct sockaddr_in *)(msghdr + 1);
 #define ADD(x) \
@@ -136,7 +536,7 @@ static size_t routemsg_add(uint8_t *buffer, int type, const Route &route) {
 	addr++;
 
 	ADD(route.addr.s_addr & bitmask(route.netmask));
-    ADD(route.gateway.s_addr);
+    ADD(gateway.s_addr);
 	ADD(bitmask(route.netmask));
 
 	/*
@@ -160,48 +560,46 @@ static size_t routemsg_add(uint8_t *buffer, int type, const Route &route) {
 	
 	return msghdr->rtm_msglen;
 }
-#endif
-
-void commit(int routefd, RouteSet deletes, RouteSet adds, RouteSet changed) {
-#ifdef __FreeBSD__
-    auto buflen = sizeof(struct rt_msghdr) + 3 * sizeof(struct sockaddr_in);
-    uint8_t buffer[buflen];
-
-    RouteLess l;
-
-    for (int i = 0; i < 5; i++) {
-        for (auto &add: adds) {
-            auto len = routemsg_add(&buffer[0], RTM_ADD, add);
-            write(routefd, &buffer[0], len);
-        }
 
-        for (auto &del: deletes) {
-            auto len = routemsg_add(&buffer[0], RTM_DELETE, del);
-            write(routefd, &buffer[0], len);
-        }
-
-        for (auto &change: changed) {
-            auto len = routemsg_add(&buffer[0], RTM_CHANGE, change);
-            write(routefd, &buffer[0], len);
-        }
-        changed.clear();
-
-        if (i < 5) {
-            auto rs = fetch(routefd);
-            RouteSet remaining_adds, remaining_deletes;
-            std::set_difference(adds.begin(), adds.end(), rs.begin(), rs.end(), std::inserter(remaining_adds, remaining_adds.begin()), l);
-            std::set_intersection(deletes.begin(), deletes.end(), rs.begin(), rs.end(), std::inserter(remaining_deletes, remaining_deletes.begin()), l);
-            if (remaining_adds.empty() && remaining_deletes.empty())
-                break;
-            adds = std::move(remaining_adds);
-            deletes = std::move(remaining_deletes);
-        }
+std::optional<Route> parse_route_message(const rt_msghdr *rtm, size_t len) {
+    if (len < sizeof(*rtm) || rtm->rtm_msglen > len ||
+        (rtm->rtm_flags & RTF_GATEWAY) == 0 ||
+        (rtm->rtm_flags & RTF_DYNAMIC) == 0 ||
+        (rtm->rtm_addrs & (RTA_DST | RTA_GATEWAY | RTA_NETMASK)) != (RTA_DST | RTA_GATEWAY | RTA_NETMASK))
+        return std::nullopt;
+    auto p = reinterpret_cast<const uint8_t *>(rtm + 1);
+    auto lim = reinterpret_cast<const uint8_t *>(rtm) + rtm->rtm_msglen;
+    // the destination, gateway and netmask come first, in that order
+    const sockaddr_in *sin[3];
+    for (int i = 0; i < 3; i++) {
+        sin[i] = reinterpret_cast<const sockaddr_in *>(p);
+        if (p + sizeof(sin[i]->sin_len) > lim || p + sin[i]->sin_len > lim)
+            return std::nullopt;
+        p += ROUNDUP(sin[i]->sin_len);
     }
-#endif
+    if (sin[0]->sin_len < sizeof(sockaddr_in) || sin[0]->sin_family != AF_INET ||
+        sin[1]->sin_len < sizeof(sockaddr_in) || sin[1]->sin_family != AF_INET)
+        return std::nullopt;
+
+    Route r;
+    r.addr.s_addr = ntohl(sin[0]->sin_addr.s_addr);
+    if (r.addr.s_addr != 0 && (r.addr.s_addr < min_routable.s_addr || r.addr.s_addr > max_routable.s_addr))
+        return std::nullopt; // not one of ours
+    r.gateways = NextHops(in_addr { ntohl(sin[1]->sin_addr.s_addr) });
+
+    /* netmask. bwurk, why the fsck all this fudging with
+       ->sin_len?! */
+    r.netmask = 0;
+    auto lim2 = reinterpret_cast<const uint8_t *>(sin[2]) + sin[2]->sin_len;
+    for (auto p2 = reinterpret_cast<const uint8_t *>(&sin[2]->sin_addr.s_addr); p2 < lim2; p2++)
+        r.netmask += __builtin_popcount(*p2);
+    return r;
 }
+#endif
 
-RouteSet fetch(int routefd) {
-    RouteSet res;
+RouteSet fetch() {
+    TraceSpan span("fetch");
+    std::vector<Route> res;
 
 #ifdef __FreeBSD__
 
@@ -209,9 +607,8 @@ RouteSet fetch(int routefd) {
     int mib[6] = { CTL_NET, PF_ROUTE, 0, 0, NET_RT_DUMP, 0 };
     size_t needed;
     std::unique_ptr<uint8_t[]> buf;
-    const uint8_t *p, *lim, *p2, *lim2;
-    struct rt_msghdr *rtm;
-    struct sockaddr_in *sin;
+    const uint8_t *p, *lim;
+    const rt_msghdr *rtm;
 
     if (sysctl(mib, 6, 0, &needed, 0, 0) == -1)
         throw std::system_error(errno, std::system_category(), "fetch of route table size");
@@ -221,38 +618,23 @@ RouteSet fetch(int routefd) {
 
     lim = &buf[needed];
     for (p = &buf[0]; p < lim; p += rtm->rtm_msglen) {
-        rtm = (struct rt_msghdr *)p;
-        if ((rtm->rtm_flags & RTF_GATEWAY) == 0 ||
-            (rtm->rtm_flags & RTF_DYNAMIC) == 0 || 
-            (rtm->rtm_addrs & RTA_NETMASK) == 0)
-            continue;
-        sin = (struct sockaddr_in *)(rtm + 1);
-        if (sin->sin_family != AF_INET)
-            continue;
+        rtm = (const rt_msghdr *)p;
+        if (auto r = parse_route_message(rtm, lim - p))
+            res.push_back(*r);
+    }
 
-        Route r;
-        r.addr = sin->sin_addr;
-        if (r.addr.s_addr != 0 && (r.addr.s_addr < min_routable.s_addr || r.addr.s_addr > max_routable.s_addr))
-            continue; // not one of ours
-        sin++;
-    
-        r.gateway = sin->sin_addr;
-        sin++;
-
-        /* netmask. bwurk, why the fsck all this fudging with
-           ->sin_len?! */
-        r.netmask = 0;
-        lim2 = (const uint8_t *)sin + sin->sin_len;
-        p2 = (const uint8_t *)&sin->sin_addr.s_addr;
-        for (; p2 < lim2; p2++)
-          r.netmask += __builtin_popcount(*p2);
-
-        res.insert(std::move(r));
+    /* every path of a multipath route comes as a separate entry. sort them
+       next to each other and fold them together */
+    std::sort(res.begin(), res.end(), [](const Route &a, const Route &b) {
+        return route_key(a) < route_key(b);
+    });
+    size_t out = 0;
+    for (size_t i = 0; i < res.size(); i++) {
+        if (out > 0 && route_key(res[out - 1]) == route_key(res[i]))
+            res[out - 1].gateways.insert(res[i].gateways.front());
+        else res[out++] = res[i];
     }
+    res.resize(out);
 #endif
-    return res;
-}
-
-void flush(int routefd) {
-    commit(routefd, fetch(routefd), {}, {});
+    return RouteSet(std::move(res));
 }
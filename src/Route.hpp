@@ -2,28 +2,190 @@
 #define ROUTE_HPP
 
 #include "common.hpp"
+#include "Arena.hpp"
 
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <netinet/in.h>
-#include <set>
+#include <optional>
 #include <tuple>
+#include <vector>
+
+/* The set of next hops for a route. Equal-cost paths to a destination all
+   end up in here, sorted on address so that two sets can be compared
+   element by element. The number of paths is capped at a small constant,
+   which keeps a Route fixed-size; the kernel only takes a handful of paths
+   per destination anyway. */
+struct NextHops {
+    static constexpr int capacity = 8;
+
+    NextHops() = default;
+    explicit NextHops(in_addr gateway): count(1) { addrs[0] = gateway; }
+
+    /* Add the given gateway, keeping the set sorted. If there are already
+       limit gateways in the set, the new one only gets in if it's lower than
+       the highest one, which then drops out. That way the numerically lowest
+       gateways win, no matter in what order they're offered. Returns whether
+       the set changed. */
+    bool insert(in_addr gateway, int limit = capacity);
+    /* Remove the given gateway. Returns whether it was in there. */
+    bool erase(in_addr gateway);
+
+    const in_addr *begin() const { return &addrs[0]; }
+    const in_addr *end() const { return &addrs[count]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const in_addr &front() const { return addrs[0]; }
+    bool contains(in_addr gateway) const;
+
+    bool operator==(const NextHops &other) const;
+    bool operator!=(const NextHops &other) const { return !(*this == other); }
+
+    uint8_t count = 0;
+    in_addr addrs[capacity];
+};
 
 struct Route {
     in_addr addr;
     int netmask;
-    in_addr gateway;
+    NextHops gateways;
 };
 
-struct RouteLess {
-    bool operator()(const Route &one, const Route &other) const {
-        if (one.addr.s_addr < other.addr.s_addr)
-            return true;
-        if (one.addr.s_addr > other.addr.s_addr)
-            return false;
-        return one.netmask < other.netmask;
+/* A route's destination packed into one integer: the address shifted left
+   by six bits, with the netmask length in those six bits. Keys sort on
+   address first and netmask second, so comparing destinations is comparing
+   integers. */
+using RouteKey = uint64_t;
+
+inline RouteKey route_key(const in_addr &addr, int netmask) {
+    return (static_cast<RouteKey>(addr.s_addr) << 6) | static_cast<RouteKey>(netmask);
+}
+
+inline RouteKey route_key(const Route &route) {
+    return route_key(route.addr, route.netmask);
+}
+
+/* A set of routes, at most one per destination, kept as two sorted arrays:
+   the RouteKeys and, at the same positions, their gateways. Walking two
+   sets side by side, as diff() and friends do, then is a merge of two
+   integer arrays instead of chasing tree nodes.
+
+   Iterating yields Routes by value, put together from the two arrays.
+   Adding a route that sorts after all others is cheap, anywhere else the
+   arrays are shifted, so sets are best built in order. */
+class RouteSet {
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Route;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Route;
+
+        const_iterator(const RouteSet *set, size_t pos): set(set), pos(pos) { }
+        Route operator*() const { return (*set)[pos]; }
+        const_iterator &operator++() { ++pos; return *this; }
+        const_iterator operator++(int) { return const_iterator(set, pos++); }
+        bool operator==(const const_iterator &other) const { return pos == other.pos; }
+        bool operator!=(const const_iterator &other) const { return pos != other.pos; }
+        size_t index() const { return pos; }
+    private:
+        const RouteSet *set;
+        size_t pos;
+    };
+
+    RouteSet() = default;
+    /* The given routes, sorted. Of routes to the same destination, the
+       first one is kept. */
+    explicit RouteSet(std::vector<Route>);
+
+    /* Add the given route, unless there already is one to its destination.
+       Returns whether it was added. */
+    bool insert(const Route &);
+    /* Add the route with the given key and gateways, which must sort after
+       every route already in the set. */
+    void push_back(RouteKey key, const NextHops &gateways) {
+        keys_.push_back(key);
+        gateways_.push_back(gateways);
+    }
+
+    const_iterator find(const Route &route) const { return find(route_key(route)); }
+    const_iterator find(RouteKey) const;
+    size_t count(const Route &route) const { return find(route) != end(); }
+    const_iterator erase(const_iterator);
+    /* Remove the routes the given predicate holds for. */
+    template<typename Pred>
+    void remove_if(Pred pred) {
+        size_t out = 0;
+        for (size_t i = 0; i < size(); i++)
+            if (!pred((*this)[i])) {
+                keys_[out] = keys_[i];
+                gateways_[out] = gateways_[i];
+                out++;
+            }
+        keys_.resize(out);
+        gateways_.resize(out);
+    }
+    void clear() {
+        keys_.clear();
+        gateways_.clear();
+    }
+    void reserve(size_t n) {
+        keys_.reserve(n);
+        gateways_.reserve(n);
+    }
+
+    Route operator[](size_t i) const {
+        Route r;
+        r.addr.s_addr = static_cast<in_addr_t>(keys_[i] >> 6);
+        r.netmask = static_cast<int>(keys_[i] & 63);
+        r.gateways = gateways_[i];
+        return r;
     }
+    RouteKey key(size_t i) const { return keys_[i]; }
+    const NextHops &gateways(size_t i) const { return gateways_[i]; }
+    NextHops &gateways(size_t i) { return gateways_[i]; }
+    const std::vector<RouteKey> &keys() const { return keys_; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+    size_t size() const { return keys_.size(); }
+    bool empty() const { return keys_.empty(); }
+
+    bool operator==(const RouteSet &other) const { return keys_ == other.keys_ && gateways_ == other.gateways_; }
+    bool operator!=(const RouteSet &other) const { return !(*this == other); }
+
+private:
+    std::vector<RouteKey> keys_;
+    std::vector<NextHops> gateways_;
 };
 
-using RouteSet = std::set<Route, RouteLess>;
+/* A longest prefix match index over a set of routes: a binary trie on the
+   address bits, with the nodes in a vector. A lookup walks at most 32 nodes,
+   no matter how many routes there are. */
+class RouteTrie {
+public:
+    RouteTrie() = default;
+    explicit RouteTrie(const RouteSet &);
+
+    /* Add the given route, replacing one with the same prefix. */
+    void insert(const Route &);
+
+    /* The most specific route that covers the given address, or nullptr. */
+    const Route *lookup(const in_addr &) const;
+
+    size_t size() const { return routes.size(); }
+
+private:
+    struct TrieNode {
+        int32_t child[2] = { -1, -1 };
+        int32_t route = -1; // index into routes, -1 if no route ends here
+    };
+    std::vector<TrieNode> nodes;
+    std::vector<Route> routes;
+};
 
 //! Does route a completely include b?
 extern bool includes(const Route &a, const Route &b);
@@ -47,45 +209,81 @@ extern std::string show(const RouteSet &);
      most convenient place to remove them code-wise.
 
      Else expand the netmask by one bit. Check if it gobbles up any routes
-     to different gateways.
+     to a different set of gateways.
        If so, move the unexpanded route to the done list and recurse.
        If not, remove all routes now covered by the newly expanded route from
          the todo list and recurse.
 
    Finally, take the now aggregated list of routes and create a set of routes,
-   with the addresses of the routes masked according to their netmask.
+   with the addresses of the routes masked according to their netmask. The
+   working lists are kept in the given arena.
 */
-extern RouteSet aggregate(const RouteSet &);
+extern RouteSet aggregate(const ScratchVector<Route> &, Arena &);
+
+/* Like aggregate(), but with the fewest routes possible, after ORTC (Draves
+   et al., "Constructing optimal IP routing tables"). Where aggregate() only
+   grows a route as long as it doesn't take in a route to other gateways,
+   this may cover those with a shorter route and put the exceptions back in
+   as more specific ones.
+
+   The host routes, sorted on address, go into a binary trie per block of
+   minimum_netmask, as no route may be shorter than that. The addresses
+   without a host route don't matter, like they don't for aggregate(). For
+   every node of the trie and every set of gateways a route above it could
+   send it to, the fewest routes needed under it follows from those of its
+   children, bottom up. Then, top down, a node gets a route where that
+   takes fewer routes than going with the one above it. Only nodes where
+   the trie branches need looking at: a route placed anywhere along a
+   branch-free stretch does the same for the addresses that matter, and it
+   is put at the top of it, to cover as much as aggregate() would. */
+extern RouteSet aggregate_optimal(const ScratchVector<Route> &, Arena &);
 
-/*  Given a set of old routes and a set of new routes, produce a list
+/* Do the given routes forward every address that has one of the given host
+   routes to the same gateways as that host route does, with no route
+   shorter than minimum_netmask? That's what both ways of aggregating must
+   get right, and what makes them agree wherever it matters. Host routes to
+   the gateway itself are left out, as aggregate() does. */
+extern bool same_forwarding(const ScratchVector<Route> &host_routes, const RouteSet &);
+
+/* Given a set of old routes and a set of new routes, produce a list
    of routes to delete, a list of routes to add and a list of routes
-   that changed their gateway.
-
-   Deletes and adds are easy using set operations. Changes are less
-   easy:
-     - Build a map from address to route for both the old and the new routes
-     - Intersect the old and the new routes. The set type orders on address
-       and netmask, so the intersection has all routes for which neither
-       address or netmask have changed. These should now be checked to see
-       if they've changed gateways.
-     - Fold this intersection, building the set of routes that changed
-       gateways along the way. For the given route, look up old and new and
-       compare the gateway. If different, add to the set, else pass along
-       the set unaltered.
-*/
+   that changed their (set of) gateways.
 
+   Both sets are sorted on destination, so this is one merge of the two key
+   arrays. Old routes whose key isn't among the new ones are deletes, new
+   routes whose key isn't among the old ones are adds, and of the keys in
+   both, the new routes with different gateways are changes. Runs of equal
+   keys, which is most of two successive route tables, and runs of keys on
+   one side only are skipped over a vector of keys at a time where the CPU
+   allows, see the kernels in Route.cpp.
+*/
 extern std::tuple<RouteSet, RouteSet, RouteSet> diff(const RouteSet &old_routes, const RouteSet &new_routes);
 
-/* Commit the given list of adds, deletes and changes to the kernel.
-   Attempt a maximum of five extra iterations of checking whether or
-   not every change was applied, and redoing those that weren't. */
-extern void commit(int routefd, RouteSet deletes, RouteSet adds, RouteSet changed);
+/* The routes in a to a destination that b has a route to as well, whatever
+   its gateways. */
+extern RouteSet intersection(const RouteSet &a, const RouteSet &b);
+
+/* The routes in a that aren't in b as they are: b has no route to their
+   destination, or one with different gateways. */
+extern RouteSet difference(const RouteSet &a, const RouteSet &b);
 
 /* Return a list of all routes to routable addresses and with a gateway in
-   the kernel route table. */
-extern RouteSet fetch(int routefd);
+   the kernel route table. The paths of a multipath route are folded back
+   into a single Route. */
+extern RouteSet fetch();
+
+struct rt_msghdr;
+
+/* Write a routing socket message of the given type, for the path through the
+   given gateway of the given route, with the given sequence number to the
+   given buffer, which needs room for a header and three sockaddr_ins.
+   Returns its length. */
+extern size_t route_message(uint8_t *buffer, int type, const Route &, const in_addr &gateway, int seq);
 
-/* Try to have the kernel get rid of all gateway routes */
-extern void flush(int routefd);
+/* The route in the given routing socket message of at most len bytes, with
+   the one gateway the message is about, if it's a route like the ones we
+   install: a dynamic route through a gateway to a routable address, or the
+   default route. */
+extern std::optional<Route> parse_route_message(const rt_msghdr *, size_t len);
 
 #endif // ROUTE_HPP
@@ -0,0 +1,90 @@
+#include "Scheduler.hpp"
+
+#include <algorithm>
+
+Throttle::Throttle(std::chrono::milliseconds min_holddown, std::chrono::milliseconds max_holddown)
+        : min_holddown(min_holddown), max_holddown(max_holddown), holddown(min_holddown),
+          last_run(Clock::now() - max_holddown) { }
+
+void Throttle::trigger(Clock::time_point now) {
+    auto since = now - last_run;
+    if (!pending && since < holddown)
+        holddown = std::min(holddown * 2, max_holddown);
+    else if (since >= 2 * max_holddown)
+        holddown = min_holddown;
+    pending = true;
+}
+
+bool Throttle::due(Clock::time_point now) const {
+    return pending && now - last_run >= holddown;
+}
+
+void Throttle::ran(Clock::time_point now) {
+    pending = false;
+    last_run = now;
+}
+
+void Throttle::set_limits(std::chrono::milliseconds min_holddown_, std::chrono::milliseconds max_holddown_) {
+    min_holddown = min_holddown_;
+    max_holddown = max_holddown_;
+    holddown = std::clamp(holddown, min_holddown, max_holddown);
+}
+
+Clock::duration Throttle::time_left(Clock::time_point now) const {
+    if (!pending)
+        return Clock::duration::max();
+    return std::max(Clock::duration::zero(), last_run + holddown - now);
+}
+
+Trickle::Trickle(std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval, unsigned redundancy)
+        : min_interval(min_interval), max_interval(max_interval), interval(min_interval), redundancy(redundancy),
+          last_sent(Clock::now()), random(std::random_device()()) {
+    start_interval(Clock::now());
+}
+
+void Trickle::start_interval(Clock::time_point now) {
+    interval_start = now;
+    std::uniform_int_distribution<Clock::rep> point(interval.count() / 2, interval.count() - 1);
+    send_at = now + std::chrono::duration_cast<Clock::duration>(std::chrono::milliseconds(point(random)));
+    counter = 0;
+    fired = false;
+}
+
+void Trickle::reset(Clock::time_point now) {
+    if (interval == min_interval)
+        return;
+    interval = min_interval;
+    start_interval(now);
+}
+
+bool Trickle::due(Clock::time_point now, bool suppressible) {
+    // a point that's only noticed after its interval is over still counts
+    if (fired && now >= interval_start + interval) {
+        interval = std::min(interval * 2, max_interval);
+        start_interval(now);
+    }
+    if (fired || now < send_at)
+        return false;
+    if (suppressible && redundancy > 0 && counter >= redundancy && now - last_sent < 2 * max_interval) {
+        fired = true;
+        return false;
+    }
+    return true;
+}
+
+void Trickle::ran(Clock::time_point now) {
+    fired = true;
+    last_sent = now;
+}
+
+Clock::duration Trickle::time_left(Clock::time_point now) const {
+    auto next = fired ? interval_start + interval : send_at;
+    return std::max(Clock::duration::zero(), next - now);
+}
+
+void Trickle::set_limits(std::chrono::milliseconds min_interval_, std::chrono::milliseconds max_interval_, unsigned redundancy_) {
+    min_interval = min_interval_;
+    max_interval = max_interval_;
+    redundancy = redundancy_;
+    interval = std::clamp(interval, min_interval, max_interval);
+}
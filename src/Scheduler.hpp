@@ -0,0 +1,96 @@
+/* This module decides when to recompute routes and when to broadcast the
+   tree, so that a storm of changes doesn't turn into a storm of runs. */
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <chrono>
+#include <random>
+
+using Clock = std::chrono::steady_clock;
+
+/* Rate limiting for something that's triggered by events.
+
+   A trigger marks the action as pending. Triggers that come in while it's
+   pending are coalesced into that one run. After a run, the next one can't
+   happen until the hold-down time has passed. The first trigger to come in
+   during the hold-down doubles it, up to the maximum, so that a steady
+   stream of triggers ends up running at the maximum interval. Once the last
+   run is twice the maximum hold-down in the past, it drops back to the
+   minimum, which is also the minimum spacing between two runs. */
+class Throttle {
+public:
+    Throttle(std::chrono::milliseconds min_holddown, std::chrono::milliseconds max_holddown);
+
+    void trigger(Clock::time_point now);
+
+    /* Is there a pending trigger whose hold-down has passed? */
+    bool due(Clock::time_point now) const;
+
+    /* Mark the action as done. */
+    void ran(Clock::time_point now);
+
+    /* How long until due() becomes true, or max() if nothing's pending. */
+    Clock::duration time_left(Clock::time_point now) const;
+
+    /* Change the hold-down limits, keeping the current hold-down within
+       them. */
+    void set_limits(std::chrono::milliseconds min_holddown, std::chrono::milliseconds max_holddown);
+
+private:
+    std::chrono::milliseconds min_holddown, max_holddown, holddown;
+    bool pending = false;
+    Clock::time_point last_run;
+};
+
+/* When to send something that neighbors need to hear now and then, but
+   more often right after it changed: a Trickle timer (RFC 6206).
+
+   Time is cut into intervals. Somewhere in the second half of each interval,
+   at a random point so that neighbors don't all send at once, it's time to
+   send, unless at least redundancy consistent packets came in during the
+   interval already and the caller says skipping is fine. Every interval is twice as long as the one before, up to
+   the maximum. Something inconsistent, like a change of our own or in what a
+   neighbor sent, starts over at the minimum interval.
+
+   A neighbor needs to hear from us to keep our tree, so sending is never
+   suppressed once it's been two maximum intervals since the last time. A
+   redundancy of zero never suppresses. */
+class Trickle {
+public:
+    Trickle(std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval, unsigned redundancy);
+
+    /* Something's inconsistent. Start over at the minimum interval, unless
+       that's where it is already. */
+    void reset(Clock::time_point now);
+
+    /* A packet came in that agrees with what we have. */
+    void consistent() { counter++; }
+
+    /* Is it time to send? Moves on to the next interval when this one is
+       over, and skips the point in this one if it's suppressed. Stays true
+       until ran(). Hearing consistent packets only says the others agree
+       with what we have, not that they have what we'd send, so it's up to
+       the caller to say whether skipping is an option at all. */
+    bool due(Clock::time_point now, bool suppressible);
+
+    /* Mark it as sent. */
+    void ran(Clock::time_point now);
+
+    /* How long until due() has something new to say. */
+    Clock::duration time_left(Clock::time_point now) const;
+
+    /* Change the limits, keeping the current interval within them. */
+    void set_limits(std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval, unsigned redundancy);
+
+private:
+    void start_interval(Clock::time_point now);
+
+    std::chrono::milliseconds min_interval, max_interval, interval;
+    unsigned redundancy;
+    unsigned counter = 0; // consistent packets in this interval
+    bool fired = false;   // the point in this interval is past
+    Clock::time_point interval_start, send_at, last_sent;
+    std::minstd_rand random;
+};
+
+#endif // SCHEDULER_HPP
@@ -0,0 +1,180 @@
+#include "Snapshot.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char snapshot_magic[4] = { 'L', 'V', 'R', 'S' };
+static constexpr uint32_t snapshot_version = 2;
+
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_routes;
+    uint32_t num_neighbors;
+};
+
+struct RouteRecord {
+    uint32_t addr;
+    uint32_t netmask;
+    uint32_t count;
+    uint32_t gateways[NextHops::capacity];
+};
+
+struct NeighborRecord {
+    uint32_t addr;
+    uint32_t seen;
+    uint32_t last_seqno;
+    uint32_t tree_len;
+    double delivery;
+    int64_t base_delay;
+    double excess_delay;
+    uint8_t tree_digest[SHA_DIGEST_LENGTH];
+};
+
+static size_t padded(size_t len) {
+    return (len + 7) & ~size_t(7);
+}
+
+static void write_all(int fd, const void *data, size_t len) {
+    auto p = static_cast<const uint8_t *>(data);
+    while (len > 0) {
+        auto written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "write snapshot");
+        }
+        p += written;
+        len -= written;
+    }
+}
+
+void save_snapshot(const std::string &path, const NeighborTable &neighbors, const RouteSet &routes) {
+    TraceSpan span("save_snapshot", nullptr, routes.size());
+    std::vector<uint8_t> out;
+    auto append = [&out](const void *data, size_t len) {
+        auto p = static_cast<const uint8_t *>(data);
+        out.insert(out.end(), p, p + len);
+    };
+
+    uint32_t num_neighbors = 0;
+    for (auto &neighbor: neighbors)
+        num_neighbors += neighbor.tree != nullptr;
+    SnapshotHeader header;
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.num_routes = routes.size();
+    header.num_neighbors = num_neighbors;
+    append(&header, sizeof(header));
+
+    for (const auto &route: routes) {
+        RouteRecord r { route.addr.s_addr, static_cast<uint32_t>(route.netmask), route.gateways.count, { 0 } };
+        for (size_t i = 0; i < route.gateways.size(); i++)
+            r.gateways[i] = route.gateways.addrs[i].s_addr;
+        append(&r, sizeof(r));
+    }
+    out.resize(padded(out.size()));
+
+    for (auto &neighbor: neighbors) {
+        if (!neighbor.tree)
+            continue;
+        auto len = serialized_size(*neighbor.tree);
+        NeighborRecord n {
+            neighbor.addr.s_addr, neighbor.link.seen, neighbor.link.last_seqno, static_cast<uint32_t>(len),
+            neighbor.link.delivery, neighbor.link.base_delay, neighbor.link.excess_delay, { 0 },
+        };
+        memcpy(n.tree_digest, neighbor.tree_digest.data(), sizeof(n.tree_digest));
+        append(&n, sizeof(n));
+        auto pos = out.size();
+        out.resize(padded(pos + len));
+        serialize(*neighbor.tree, &out[pos], len);
+    }
+
+    auto tmp = path + ".tmp";
+    {
+        FileDescriptor fd(open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+        if (fd.fd == -1)
+            throw std::system_error(errno, std::system_category(), "open " + tmp);
+        write_all(fd.fd, out.data(), out.size());
+        if (fsync(fd.fd) < 0)
+            throw std::system_error(errno, std::system_category(), "fsync " + tmp);
+    }
+    if (rename(tmp.data(), path.data()) < 0)
+        throw std::system_error(errno, std::system_category(), "rename " + tmp);
+}
+
+std::optional<Snapshot> load_snapshot(const std::string &path) {
+    FileDescriptor fd(open(path.data(), O_RDONLY));
+    if (fd.fd == -1) {
+        if (errno == ENOENT)
+            return std::nullopt;
+        throw std::system_error(errno, std::system_category(), "open " + path);
+    }
+    struct stat st;
+    if (fstat(fd.fd, &st) < 0)
+        throw std::system_error(errno, std::system_category(), "stat " + path);
+    size_t size = st.st_size;
+    if (size < sizeof(SnapshotHeader))
+        throw std::runtime_error("Snapshot " + path + " is truncated");
+    auto map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+    if (map == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "mmap " + path);
+    std::unique_ptr<void, std::function<void (void *)>> g(map, [size](void *p) { munmap(p, size); });
+    auto base = static_cast<const uint8_t *>(map);
+
+    auto header = reinterpret_cast<const SnapshotHeader *>(base);
+    if (memcmp(header->magic, snapshot_magic, sizeof(header->magic)) != 0)
+        throw std::runtime_error(path + " is not a snapshot");
+    if (header->version != snapshot_version)
+        throw std::runtime_error("Unsupported snapshot version " + std::to_string(header->version));
+    size_t pos = sizeof(SnapshotHeader);
+    if (header->num_routes > (size - pos) / sizeof(RouteRecord))
+        throw std::runtime_error("Snapshot " + path + " is truncated");
+
+    Snapshot res;
+    auto records = reinterpret_cast<const RouteRecord *>(base + pos);
+    for (uint32_t i = 0; i < header->num_routes; i++) {
+        auto &r = records[i];
+        if (r.netmask > 32 || r.count > NextHops::capacity)
+            throw std::runtime_error("Invalid route in snapshot " + path);
+        Route route;
+        route.addr.s_addr = r.addr;
+        route.netmask = r.netmask;
+        for (uint32_t j = 0; j < r.count; j++)
+            route.gateways.insert(in_addr { r.gateways[j] });
+        res.routes.insert(route);
+    }
+    pos = std::min(size, padded(pos + header->num_routes * sizeof(RouteRecord)));
+
+    for (uint32_t i = 0; i < header->num_neighbors; i++) {
+        if (size - pos < sizeof(NeighborRecord))
+            throw std::runtime_error("Snapshot " + path + " is truncated");
+        auto n = reinterpret_cast<const NeighborRecord *>(base + pos);
+        pos += sizeof(NeighborRecord);
+        if (size - pos < n->tree_len)
+            throw std::runtime_error("Snapshot " + path + " is truncated");
+        Snapshot::NeighborState state;
+        state.addr.s_addr = n->addr;
+        state.link.seen = n->seen;
+        state.link.last_seqno = n->last_seqno;
+        state.link.delivery = n->delivery;
+        state.link.base_delay = n->base_delay;
+        state.link.excess_delay = n->excess_delay;
+        memcpy(state.tree_digest.data(), n->tree_digest, state.tree_digest.size());
+        auto tree = deserialize(base + pos, n->tree_len);
+        tree.addr = state.addr;
+        state.tree = std::make_shared<const Node>(std::move(tree));
+        res.neighbors.push_back(std::move(state));
+        pos = std::min(size, padded(pos + n->tree_len));
+    }
+    return res;
+}
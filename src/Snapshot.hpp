@@ -0,0 +1,44 @@
+/* This module saves the state that takes a while to build up, the trees
+   the neighbors sent and the routes derived from them, so that a restarted
+   daemon can pick up where the previous one left off instead of starting
+   from nothing and withdrawing good routes while it relearns them. */
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Neighbor.hpp"
+#include "Route.hpp"
+
+struct Snapshot {
+    struct NeighborState {
+        in_addr addr;
+        LinkStats link;
+        NodePtr tree;
+        TreeDigest tree_digest;
+    };
+    std::vector<NeighborState> neighbors;
+    RouteSet routes;
+};
+
+/* Write the trees and link statistics of the given neighbors and the given
+   routes to the given file. The file is written next to the old one and then
+   renamed over it, so a crash halfway leaves the previous snapshot intact.
+
+   The layout is fixed-size records in host byte order, made to be read back
+   with mmap() by the same machine:
+     - a header with a magic number, a version and the number of routes and
+       neighbors
+     - the routes, each with all NextHops::capacity gateway slots, padded
+       to a multiple of 8 bytes
+     - the neighbors, each with the digest of its tree, followed by the tree in the wire format of
+       serialize(), padded to a multiple of 8 bytes */
+void save_snapshot(const std::string &path, const NeighborTable &, const RouteSet &);
+
+/* Read a snapshot written by save_snapshot(). Returns nothing if there is
+   none, and throws a runtime_error if it can't be used. */
+std::optional<Snapshot> load_snapshot(const std::string &path);
+
+#endif // SNAPSHOT_HPP
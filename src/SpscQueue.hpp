@@ -0,0 +1,64 @@
+/* A queue between exactly two threads, one that pushes and one that pops,
+   without locks. The decode pool hands packets and results back and forth
+   with these, so that the main loop never waits for a thread that's busy
+   checking a signature. */
+#ifndef SPSCQUEUE_HPP
+#define SPSCQUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
+/* A ring of a fixed number of slots, a power of two. The pushing thread
+   only writes tail and the popping thread only writes head, each publishing
+   its slot with a release store that the other side picks up with an
+   acquire load. */
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity): mask(capacity - 1), slots(new T[capacity]) {
+        if (capacity == 0 || (capacity & mask) != 0)
+            throw std::logic_error("SpscQueue capacity must be a power of two");
+    }
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    /* Only for the pushing thread. Returns false, leaving the value alone,
+       if the queue is full. */
+    bool push(T &&value) {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask)
+            return false;
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Only for the popping thread. */
+    std::optional<T> pop() {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return std::nullopt;
+        std::optional<T> res(std::move(slots[h & mask]));
+        slots[h & mask] = T();
+        head.store(h + 1, std::memory_order_release);
+        return res;
+    }
+
+    /* From either thread, though it may be out of date by the time it
+       returns. */
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    const size_t mask;
+    std::unique_ptr<T[]> slots;
+    // on cache lines of their own, so the two threads don't fight over them
+    alignas(64) std::atomic<size_t> head { 0 };
+    alignas(64) std::atomic<size_t> tail { 0 };
+};
+
+#endif // SPSCQUEUE_HPP
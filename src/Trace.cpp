@@ -0,0 +1,146 @@
+#include "Trace.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+std::atomic<bool> tracing { false };
+
+struct Event {
+    const char *name;
+    const char *detail;
+    int64_t value;
+    int64_t start;
+    int64_t duration; // -1 for an instant
+};
+
+/* The spans of one thread. Only that thread writes to it, but write_trace()
+   reads it from another, so the ring has a lock of its own, which is
+   practically always free. */
+struct Ring {
+    std::mutex mutex;
+    int tid;
+    std::string name;
+    Event events[trace_ring_size];
+    uint64_t count = 0; // ever recorded, so the oldest one is at count - trace_ring_size
+};
+
+static std::mutex rings_mutex;
+static std::vector<std::shared_ptr<Ring>> rings; // never shrinks; threads come and go rarely
+
+/* The ring is only made once a thread records something, so threads don't
+   carry one around while tracing is off. */
+static thread_local std::shared_ptr<Ring> my_ring;
+static thread_local const char *my_name = nullptr;
+
+static Ring &ring() {
+    if (!my_ring) {
+        my_ring = std::make_shared<Ring>();
+        std::lock_guard<std::mutex> l(rings_mutex);
+        my_ring->tid = rings.size() + 1;
+        my_ring->name = my_name ? my_name : "thread " + std::to_string(my_ring->tid);
+        rings.push_back(my_ring);
+    }
+    return *my_ring;
+}
+
+static void record(const Event &event) {
+    auto &r = ring();
+    std::lock_guard<std::mutex> l(r.mutex);
+    r.events[r.count++ % trace_ring_size] = event;
+}
+
+static void write_string(std::ostream &os, const char *s) {
+    os << '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            os << '\\';
+        if (static_cast<unsigned char>(*s) >= 0x20)
+            os << *s;
+    }
+    os << '"';
+}
+
+int64_t trace_clock() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_span(const char *name, const char *detail, int64_t value, int64_t start) {
+    record({ name, detail, value, start, trace_clock() - start });
+}
+
+void trace_instant(const char *name, const char *detail) {
+    if (tracing.load(std::memory_order_relaxed))
+        record({ name, detail, -1, trace_clock(), -1 });
+}
+
+void trace_thread_name(const char *name) {
+    my_name = name;
+    if (my_ring) {
+        std::lock_guard<std::mutex> l(my_ring->mutex);
+        my_ring->name = name;
+    }
+}
+
+void write_trace(const std::string &path) {
+    std::vector<std::shared_ptr<Ring>> all;
+    {
+        std::lock_guard<std::mutex> l(rings_mutex);
+        all = rings;
+    }
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream ofs(tmp);
+        auto pid = getpid();
+        const char *sep = "";
+        ofs << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        for (auto &r: all) {
+            // copy under the lock, and format without holding it up
+            std::vector<Event> events;
+            std::string name;
+            {
+                std::lock_guard<std::mutex> l(r->mutex);
+                auto first = r->count > trace_ring_size ? r->count - trace_ring_size : 0;
+                for (auto i = first; i < r->count; i++)
+                    events.push_back(r->events[i % trace_ring_size]);
+                name = r->name;
+            }
+            ofs << sep << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid << ",\"tid\":" << r->tid
+                << ",\"args\":{\"name\":";
+            write_string(ofs, name.data());
+            ofs << "}}";
+            sep = ",";
+            for (auto &e: events) {
+                ofs << ",\n{\"name\":";
+                write_string(ofs, e.name);
+                if (e.duration < 0)
+                    ofs << ",\"ph\":\"i\",\"s\":\"p\"";
+                else ofs << ",\"ph\":\"X\",\"dur\":" << e.duration;
+                ofs << ",\"ts\":" << e.start << ",\"pid\":" << pid << ",\"tid\":" << r->tid;
+                if (e.detail || e.value >= 0) {
+                    ofs << ",\"args\":{";
+                    if (e.detail) {
+                        ofs << "\"detail\":";
+                        write_string(ofs, e.detail);
+                    }
+                    if (e.value >= 0)
+                        ofs << (e.detail ? "," : "") << "\"value\":" << e.value;
+                    ofs << "}";
+                }
+                ofs << "}";
+            }
+        }
+        ofs << "\n]}\n";
+        if (!ofs)
+            throw std::system_error(errno, std::system_category(), "write " + tmp);
+    }
+    if (rename(tmp.data(), path.data()) < 0)
+        throw std::system_error(errno, std::system_category(), "rename " + tmp);
+}
@@ -0,0 +1,65 @@
+/* This module records where the time goes in individual runs: spans for the
+   phases of a route computation, a broadcast or a commit, on whatever
+   thread they run, written out on request in the Chrome trace event format
+   that chrome://tracing and Perfetto read. */
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* Whether spans are recorded. When they aren't, a span costs a relaxed load
+   of this and a branch. */
+extern std::atomic<bool> tracing;
+
+/* Microseconds on the steady clock, which is what the spans are in. */
+int64_t trace_clock();
+
+/* Record a span with the given name that started at the given time and ends
+   now. The name and detail must be string literals, or at least outlive
+   the process, because only the pointers are kept. The value is shown with
+   the span if it's not negative. Every thread records into a ring of its
+   own, which holds the last trace_ring_size spans. */
+void trace_span(const char *name, const char *detail, int64_t value, int64_t start);
+
+/* Record something that happened at a single point in time, like a trigger
+   for a run. */
+void trace_instant(const char *name, const char *detail);
+
+/* Name the calling thread in the trace. */
+void trace_thread_name(const char *name);
+
+/* Write what the rings hold to the given file as Chrome trace event JSON.
+   Throws a system_error if the file can't be written. */
+void write_trace(const std::string &path);
+
+constexpr size_t trace_ring_size = 4096;
+
+/* A span that lasts as long as this object does:
+
+     {
+         TraceSpan span("merge");
+         ...
+     }
+*/
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, const char *detail = nullptr, int64_t value = -1)
+            : name(name), detail(detail), value(value),
+              start(tracing.load(std::memory_order_relaxed) ? trace_clock() : -1) { }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+    ~TraceSpan() {
+        if (start >= 0)
+            trace_span(name, detail, value, start);
+    }
+
+private:
+    const char *name;
+    const char *detail;
+    int64_t value;
+    int64_t start;
+};
+
+#endif // TRACE_HPP
@@ -1,11 +1,25 @@
 #include "Tree.hpp"
+#include "Trace.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <syslog.h>
+#include <mutex>
 #include <queue>
 #include <sstream>
+#include <unordered_map>
 #include <arpa/inet.h>
 #include <cassert>
+#include <cstring>
+
+/* the layout of a node on the wire. see serialize_node() */
+static constexpr uint32_t addr_mask = (1 << 20) - 1;
+static constexpr uint32_t ethernet_bit = 1 << 20;
+static constexpr uint32_t gateway_bit = 1 << 21;
+static constexpr int count_shift = 22;
+static constexpr uint32_t count_escape = (1 << 10) - 1;
+static constexpr uint8_t metric_escape = 0xff;
+static constexpr ptrdiff_t min_node_size = sizeof(uint32_t) + sizeof(uint8_t);
 
 void bfs(const Node &node, const std::function<bool (const Node &)> &f) {
     std::queue<const Node *> q;
@@ -16,174 +30,517 @@ void bfs(const Node &node, const std::function<bool (const Node &)> &f) {
         if (!f(*top))
             break;
         for (auto &c: top->children)
-            q.push(&c);
+            q.push(c.get());
     }
 }
-static void to_string_helper(std::ostringstream &oss, size_t indent, const std::vector<Node> &nodes) {
-    std::string tabs(indent, '\t');
+
+bool operator==(const Node &a, const Node &b) {
+    return a.addr.s_addr == b.addr.s_addr &&
+           a.ethernet == b.ethernet &&
+           a.gateway == b.gateway &&
+           a.metric == b.metric &&
+           std::equal(a.children.begin(), a.children.end(), b.children.begin(), b.children.end(),
+                      [](const NodePtr &x, const NodePtr &y) { return x == y || *x == *y; });
+}
+
+bool same_tree(const std::vector<NodePtr> &a, const std::vector<NodePtr> &b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](const NodePtr &x, const NodePtr &y) { return x == y || *x == *y; });
+}
+
+static void to_string_helper(std::ostream &oss, size_t indent, const std::vector<NodePtr> &nodes) {
     for (auto &child: nodes) {
-        oss << tabs << inet_ntoa({ htonl(child.addr.s_addr) });
-        if (child.ethernet)
+        for (size_t i = 0; i < indent; i++)
+            oss << '\t';
+        oss << show(child->addr);
+        if (child->ethernet)
             oss << " (eth)";
-        if (child.gateway)
+        if (child->gateway)
             oss << " (gw)";
+        oss << " [" << static_cast<int>(child->metric) << "]";
         oss << std::endl;
-        to_string_helper(oss, indent + 1, child.children);
+        to_string_helper(oss, indent + 1, child->children);
     }
 }
-std::string to_string(const std::vector<Node> &nodes) {
+std::string to_string(const std::vector<NodePtr> &nodes) {
     std::ostringstream oss;
     to_string_helper(oss, 0, nodes);
     return oss.str();
 }
 
-std::tuple<Node, RouteSet, in_addr> merge(const std::vector<Node> &trees) {
-    Node new_tree;
-    new_tree.addr.s_addr = 0;
-    new_tree.ethernet = false;
-    new_tree.gateway = false;
-    new_tree.children.reserve(trees.size());
+void print(std::ostream &os, const std::vector<NodePtr> &nodes) {
+    to_string_helper(os, 0, nodes);
+}
+
+/* A node of the tree merge() builds, before it's known whether it has to be
+   built at all. The nodes are numbered in the order they're taken, with the
+   top node at 0, and the children of a node are a range in a list of those
+   numbers. */
+struct MergedNode {
+    in_addr addr;
+    bool ethernet;
+    bool gateway;
+    uint16_t metric;
+    size_t parent;
+    size_t first_child, end_child;
+};
+
+static NodePtr build(const ScratchVector<MergedNode> &, const ScratchVector<size_t> &, size_t, const NodePtr *, Arena &);
+
+/* Build the children of the given node into out, reusing the given children
+   it had in the previous tree where they're the same. Those are matched on
+   address, in order, looking past one that isn't there anymore, so that a
+   child coming or going doesn't have all the ones after it built again.
+   Returns whether all children are the same as before. */
+static bool build_children(const ScratchVector<MergedNode> &nodes, const ScratchVector<size_t> &children, size_t i,
+                           const std::vector<NodePtr> *previous, ScratchVector<NodePtr> &out, Arena &arena) {
+    auto &n = nodes[i];
+    auto count = n.end_child - n.first_child;
+    out.reserve(count);
+    bool same = previous && previous->size() == count;
+    size_t next = 0; // in previous
+    for (size_t k = 0; k < count; k++) {
+        auto child = children[n.first_child + k];
+        const NodePtr *before = nullptr;
+        for (auto j = next; previous && j < previous->size() && j < next + 2; j++)
+            if ((*previous)[j]->addr.s_addr == nodes[child].addr.s_addr) {
+                before = &(*previous)[j];
+                next = j + 1;
+                break;
+            }
+        out.push_back(build(nodes, children, child, before, arena));
+        same = same && before == &(*previous)[k] && out.back() == *before;
+    }
+    return same;
+}
+
+/* Build the given node, or return the one that was in its place in the
+   previous tree, if any, when nothing at or under it changed. */
+static NodePtr build(const ScratchVector<MergedNode> &nodes, const ScratchVector<size_t> &children, size_t i,
+                     const NodePtr *previous, Arena &arena) {
+    auto &n = nodes[i];
+    ScratchVector<NodePtr> built { ArenaAllocator<NodePtr>(arena) };
+    bool same = build_children(nodes, children, i, previous ? &(*previous)->children : nullptr, built, arena);
+    if (same && (*previous)->addr.s_addr == n.addr.s_addr && (*previous)->ethernet == n.ethernet &&
+        (*previous)->gateway == n.gateway && (*previous)->metric == n.metric)
+        return *previous;
+    auto res = std::make_shared<Node>();
+    res->addr = n.addr;
+    res->ethernet = n.ethernet;
+    res->gateway = n.gateway;
+    res->metric = n.metric;
+    res->children.assign(std::make_move_iterator(built.begin()), std::make_move_iterator(built.end()));
+    return res;
+}
+
+std::tuple<ScratchVector<Route>, ScratchVector<GatewayPath>> merge(const ScratchVector<MergeRoot> &trees, std::vector<NodePtr> &tree, Arena &arena) {
+    TraceSpan span("merge", nullptr, trees.size());
+    ScratchVector<MergedNode> nodes { ArenaAllocator<MergedNode>(arena) };
+    nodes.push_back({ in_addr { 0 }, false, false, 0, 0, 0, 0 });
 
     struct in_addr_less {
         bool operator()(const in_addr &one, const in_addr &other) const {
             return one.s_addr < other.s_addr;
         }
     };
-    std::map<in_addr, std::pair<in_addr, uint8_t>, in_addr_less> routes_with_path_lengths; // address -> gateway + #hops
+    struct RouteWithPathLength {
+        NextHops gateways;
+        uint32_t cost;
+        size_t copy; // the node in the new tree
+        size_t depth; // of the copy
+    };
+    using RouteMapAllocator = ArenaAllocator<std::pair<const in_addr, RouteWithPathLength>>;
+    std::map<in_addr, RouteWithPathLength, in_addr_less, RouteMapAllocator> routes_with_path_lengths { RouteMapAllocator(arena) };
 
     struct PriorityQueueElement {
-        PriorityQueueElement(uint8_t cost, const Node &node, Node &parent, in_addr gateway) noexcept
-                : cost(cost), node(&node), parent(&parent), gateway(gateway) { }
-        uint8_t cost;
+        PriorityQueueElement(uint32_t cost, const Node &node, const std::vector<NodePtr> &children, size_t parent, size_t depth, in_addr gateway) noexcept
+                : cost(cost), node(&node), children(&children), parent(parent), depth(depth), gateway(gateway) { }
+        uint32_t cost;
         const Node *node;
-        Node *parent;
+        const std::vector<NodePtr> *children; // of node, or of the neighbor's tree for a top-level one
+        size_t parent; // in the new tree
+        size_t depth; // the node would get in the new tree
         in_addr gateway;
         bool operator<(const PriorityQueueElement &o) const {
             return cost > o.cost;
         }
     };
-    std::priority_queue<PriorityQueueElement> todo;
-    for (auto &tree: trees) {
-        todo.emplace(0, tree, new_tree, tree.addr);
+    std::priority_queue<PriorityQueueElement, ScratchVector<PriorityQueueElement>> todo {
+        std::less<PriorityQueueElement>(), ScratchVector<PriorityQueueElement>(ArenaAllocator<PriorityQueueElement>(arena))
+    };
+    // the top-level nodes, without children so that they don't need copying
+    ScratchVector<Node> tops { ArenaAllocator<Node>(arena) };
+    tops.reserve(trees.size());
+    for (auto &root: trees) {
+        Node n;
+        n.addr = root.addr;
+        n.ethernet = root.ethernet;
+        n.gateway = root.gateway;
+        n.metric = root.metric;
+        tops.push_back(std::move(n));
+        todo.emplace(root.metric, tops.back(), *root.children, 0, 1, root.addr);
     }
-    in_addr default_gateway { 0 };
+    ScratchVector<GatewayPath> gateways { ArenaAllocator<GatewayPath>(arena) };
+    // nodes come out in order of cost, so the first gateway through a next hop is the nearest one
+    auto gateway_through = [&gateways](in_addr next_hop, uint32_t cost) {
+        for (auto &g: gateways)
+            if (g.next_hop.s_addr == next_hop.s_addr)
+                return;
+        gateways.push_back({ next_hop, cost });
+    };
     while (!todo.empty()) {
         auto em = todo.top();
         todo.pop();
-        if (default_gateway.s_addr == 0 && em.node->gateway)
-            default_gateway = em.node->addr;
+        size_t copy;
+        size_t depth;
         auto it = routes_with_path_lengths.find(em.node->addr);
         if (it != routes_with_path_lengths.end()) {
-            auto &existing_gw = it->second.first;
-            auto &existing_cost = it->second.second;
-            if (existing_cost == em.cost && existing_gw.s_addr < em.gateway.s_addr)
-                existing_gw = em.gateway;
-            else if (em.cost < existing_cost) {
+            auto &existing = it->second;
+            if (em.cost < existing.cost) {
                 // we've seen this node before yet this one's cost is lower. that can't be.
                 throw std::logic_error("Eep!");
-            } else {
-                // we've seen this node before and this one's cost is higher than what we have. ignore.
             }
+            if (em.cost > existing.cost || !existing.gateways.insert(em.gateway, max_multipath)) {
+                // we've seen this node before and this path has nothing new to offer. ignore.
+                continue;
+            }
+            // an extra next hop at the same cost. pass that on to the children.
+            copy = existing.copy;
+            depth = existing.depth;
+            if (nodes[copy].gateway)
+                gateway_through(em.gateway, em.cost);
         } else {
             // copy this node and hook it into the new tree
             assert(em.node);
-            Node new_node;
-            new_node.addr = em.node->addr;
-            new_node.ethernet = em.node->ethernet;
-            new_node.gateway = em.node->gateway;
-            new_node.children.reserve(em.node->children.size());
-            em.parent->children.push_back(std::move(new_node));
-            auto &copy = em.parent->children.back();
-            routes_with_path_lengths.emplace(copy.addr, std::make_pair(em.gateway, em.cost));
-
-            /*
-             * Create queue elements for the children of this node and push them on. For ethernet
-             * links the cost is the parent cost plus 1 else it's the parent cost plus 10. This
-             * then strongly prefers paths going over wired connections.
-             */
-            auto new_cost = em.cost + (em.node->ethernet ? 1 : 10);
-            for (auto &child: em.node->children)
-                todo.emplace(new_cost, child, copy, em.gateway);
+            nodes.push_back({ em.node->addr, em.node->ethernet, em.node->gateway, em.node->metric, em.parent, 0, 0 });
+            copy = nodes.size() - 1;
+            depth = em.depth;
+            routes_with_path_lengths.emplace(em.node->addr, RouteWithPathLength { NextHops(em.gateway), em.cost, copy, depth });
+            if (nodes[copy].gateway)
+                gateway_through(em.gateway, em.cost);
         }
+
+        /*
+         * Create queue elements for the children of this node and push them on. The cost
+         * of a child is the cost of this node plus the metric of the link to the child,
+         * which is whatever this node measured that link to be. A path that would cost more
+         * than max_path_cost is taken to not be a path at all, and so is one that would make
+         * the new tree deeper than max_tree_depth.
+         */
+        if (depth >= max_tree_depth)
+            continue;
+        for (auto &child: *em.children)
+            if (child->metric <= max_path_cost - em.cost)
+                todo.emplace(em.cost + child->metric, *child, child->children, copy, depth + 1, em.gateway);
+    }
+
+    // the children of every node in the order they were taken, which is the
+    // order they go in the tree. then the tree, sharing what didn't change.
+    ScratchVector<size_t> children(nodes.size() - 1, 0, ArenaAllocator<size_t>(arena));
+    for (size_t i = 1; i < nodes.size(); i++)
+        nodes[nodes[i].parent].end_child++;
+    for (size_t i = 0, first = 0; i < nodes.size(); i++) {
+        nodes[i].first_child = first;
+        first += nodes[i].end_child;
+        nodes[i].end_child = nodes[i].first_child;
     }
+    for (size_t i = 1; i < nodes.size(); i++)
+        children[nodes[nodes[i].parent].end_child++] = i;
+    ScratchVector<NodePtr> top { ArenaAllocator<NodePtr>(arena) };
+    if (!build_children(nodes, children, 0, &tree, top, arena))
+        tree.assign(std::make_move_iterator(top.begin()), std::make_move_iterator(top.end()));
 
-    RouteSet routing_table;
+    ScratchVector<Route> routing_table { ArenaAllocator<Route>(arena) };
+    routing_table.reserve(routes_with_path_lengths.size());
     for (auto &p: routes_with_path_lengths) {
         Route r;
         r.addr = p.first;
         r.netmask = 32;
-        r.gateway = p.second.first;
-        routing_table.insert(std::move(r));
+        r.gateways = p.second.gateways;
+        routing_table.push_back(std::move(r));
     }
     
-    return { std::move(new_tree), std::move(routing_table), std::move(default_gateway) };
+    return { std::move(routing_table), std::move(gateways) };
 }
 
-/* Store a node into a buffer. It is enough to store the node contents
- * (the address in this case) plus the number of children and recurse.
- * Since the 172.16.0.0/12 range only uses 20 bits, the number of children
- * can be packed into the 12 fixed bits.
- * 
- * It is conceivable for our nodes to have more than 16 addresses to
- * propagate, so packing a node in 24 bits instead of 32 would probably
- * be pushing our luck.
+/* Little helpers to store and load a value at a cursor in a buffer, as long
+ * as it fits before the given limit. Byte order is up to the caller.
  */
-static uint8_t *serialize_rec(const Node &node, uint8_t *buffer, uint8_t *boundary) {
-	if (buffer >= boundary)
+template<typename T>
+static uint8_t *put(uint8_t *buffer, const uint8_t *boundary, T value) {
+    if (boundary - buffer < static_cast<ptrdiff_t>(sizeof(T)))
         throw std::runtime_error("Buffer too small for tree");
+    memcpy(buffer, &value, sizeof(T));
+    return buffer + sizeof(T);
+}
+
+template<typename T>
+static T get(const uint8_t **pp, const uint8_t *limit) {
+    if (limit - *pp < static_cast<ptrdiff_t>(sizeof(T)))
+        throw std::runtime_error("Faulty packet");
+    T value;
+    memcpy(&value, *pp, sizeof(T));
+    *pp += sizeof(T);
+    return value;
+}
+
+/* Visit the nodes of the given tree in the order they go on the wire: a
+ * node, then the subtrees of its children one after the other. The walk
+ * keeps its own stack of at most max_tree_depth entries instead of
+ * recursing, and throws a runtime_error for a tree that's deeper than that
+ * or has a node with too many children to encode.
+ */
+template<typename F>
+static void preorder(const Node &top, F visit) {
+    struct Frame {
+        const Node *node;
+        size_t next; // the child to go into next
+    };
+    Frame stack[max_tree_depth + 1];
+    size_t depth = 0;
+    stack[0] = { &top, 0 };
+    visit(top);
+    while (true) {
+        auto &frame = stack[depth];
+        if (frame.next == 0 && frame.node->children.size() > max_children)
+            throw std::runtime_error("Too many children in tree node");
+        if (frame.next == frame.node->children.size()) {
+            if (depth == 0)
+                break;
+            depth--;
+            continue;
+        }
+        auto &child = *frame.node->children[frame.next++];
+        if (depth == max_tree_depth)
+            throw std::runtime_error("Tree too deep");
+        visit(child);
+        stack[++depth] = { &child, 0 };
+    }
+}
+
+/* Store a node into a buffer. It is enough to store the node contents
+ * (the address in this case) plus the number of children, followed by the
+ * children, depth first. Since the 172.16.0.0/12 range only uses 20 bits,
+ * the flags and the number of children can be packed into the 12 bits
+ * above the address:
+ *
+ *   bits  0-19  the address
+ *   bit     20  ethernet
+ *   bit     21  gateway
+ *   bits 22-31  the number of children, or all ones if that doesn't fit
+ *               and the number follows in 16 bits
+ *
+ * After that word comes the link metric in a byte, or 0xff followed by the
+ * metric in 16 bits. That way a node usually takes five bytes, which is
+ * what lets a gateway with thousands of neighbors and addresses still fit
+ * its tree in a single packet.
+ */
+static size_t node_size(const Node &node) {
+    return sizeof(uint32_t) +
+           (node.children.size() >= count_escape ? sizeof(uint16_t) : 0) +
+           (node.metric < metric_escape ? sizeof(uint8_t) : sizeof(uint8_t) + sizeof(uint16_t));
+}
 
-	/* put the number of children in the six sixth-to-last bits */
-	uint32_t i = node.children.size() << 20;
-	/* or in the the "eth" boolean in the upper six bits */
+static uint8_t *serialize_node(const Node &node, uint8_t *buffer, uint8_t *boundary) {
+    auto count = static_cast<uint32_t>(node.children.size());
+    uint32_t i = std::min(count, count_escape) << count_shift;
     if (node.ethernet)
-        i |= 1 << 26;
+        i |= ethernet_bit;
     if (node.gateway)
-        i |= 1 << 27;
-	/* mask out the 20 relevant bits and or the address in */
-    i |= node.addr.s_addr & ((1 << 20) - 1);
-	/* that's all for this node. store it. */
-	*(uint32_t *)buffer = htonl(i);
-	buffer += sizeof(int);
-
-    for (auto &child: node.children)
-        buffer = serialize_rec(child, buffer, boundary);
+        i |= gateway_bit;
+    i |= node.addr.s_addr & addr_mask;
+    buffer = put<uint32_t>(buffer, boundary, htonl(i));
+    if (count >= count_escape)
+        buffer = put<uint16_t>(buffer, boundary, htons(count));
+    if (node.metric < metric_escape)
+        buffer = put<uint8_t>(buffer, boundary, node.metric);
+    else {
+        buffer = put<uint8_t>(buffer, boundary, metric_escape);
+        buffer = put<uint16_t>(buffer, boundary, htons(node.metric));
+    }
     return buffer;
 }
 
+size_t serialized_size(const Node &node) {
+    size_t res = 0;
+    preorder(node, [&res](const Node &n) { res += node_size(n); });
+    return res;
+}
+
 size_t serialize(const Node &node, uint8_t *buf, size_t len) {
-    return serialize_rec(node, buf, buf + len) - buf;
+    if (serialized_size(node) > len)
+        throw std::runtime_error("Buffer too small for tree");
+    auto p = buf;
+    preorder(node, [&p, buf, len](const Node &n) { p = serialize_node(n, p, buf + len); });
+    return p - buf;
 }
 
-/* This is the converse of tree_to_string_rec(). Unpack the packed-together
- * number of children and node address.
+/* The pool of interned nodes. Since children are interned before their
+ * parents, two nodes have the same contents exactly when their own fields
+ * are the same and their children are the same objects, so neither hashing
+ * nor comparing needs to look further down the tree.
+ */
+struct InternPool {
+    static size_t hash(const Node &n) {
+        size_t h = std::hash<uint32_t>()(n.addr.s_addr);
+        auto mix = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2); };
+        mix(n.ethernet | (n.gateway << 1) | (n.metric << 2));
+        for (auto &child: n.children)
+            mix(std::hash<const Node *>()(child.get()));
+        return h;
+    }
+
+    static bool same(const Node &a, const Node &b) {
+        return a.addr.s_addr == b.addr.s_addr &&
+               a.ethernet == b.ethernet &&
+               a.gateway == b.gateway &&
+               a.metric == b.metric &&
+               a.children == b.children;
+    }
+
+    NodePtr intern(Node &&n) {
+        auto h = hash(n);
+        auto range = nodes.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+            if (auto existing = it->second.lock(); existing && same(*existing, n))
+                return existing;
+        auto res = std::make_shared<const Node>(std::move(n));
+        nodes.emplace(h, res);
+        if (nodes.size() >= 2 * live_after_sweep)
+            sweep();
+        return res;
+    }
+
+    /* Forget about the nodes that have died. This is done whenever the
+     * pool has doubled in size since the last time, so it's cheap when
+     * spread out over the inserts.
+     */
+    void sweep() {
+        for (auto it = nodes.begin(); it != nodes.end(); )
+            if (it->second.expired())
+                it = nodes.erase(it);
+            else
+                ++it;
+        live_after_sweep = std::max(nodes.size(), min_sweep_size);
+    }
+
+    static constexpr size_t min_sweep_size = 1024;
+    std::mutex mutex; // packets are decoded on several threads at once
+    std::unordered_multimap<size_t, std::weak_ptr<const Node>> nodes;
+    size_t live_after_sweep = min_sweep_size;
+};
+static InternPool pool;
+
+/* A node as it is on the wire, with the number of its children. */
+struct WireNode {
+    in_addr addr;
+    bool ethernet;
+    bool gateway;
+    uint16_t metric;
+    uint32_t count;
+};
+
+/* This is the converse of serialize_node(). Unpack the packed-together
+ * number of children, flags and node address, plus the metric.
  *
- * NOTE: the upper six bits are reserved and not relevant to this branch of
- * the code. They are explicitly ignored here in order not to trip up if
- * there's anything there.
+ * A node can't take less than five bytes, so a child count that wouldn't
+ * fit in what's left of the packet is rejected right away.
  */
-static Node decode_tree_rec(const uint8_t **pp,
-                            const uint8_t *limit) {
-    if (*pp > limit - sizeof(int))
+static WireNode decode_node(const uint8_t **pp, const uint8_t *limit) {
+    auto i = ntohl(get<uint32_t>(pp, limit));
+    WireNode n;
+    n.addr.s_addr = 0xac100000 + (i & addr_mask);
+    n.ethernet = i & ethernet_bit;
+    n.gateway = i & gateway_bit;
+    n.count = i >> count_shift;
+    if (n.count == count_escape)
+        n.count = ntohs(get<uint16_t>(pp, limit));
+    auto metric = get<uint8_t>(pp, limit);
+    n.metric = metric == metric_escape ? ntohs(get<uint16_t>(pp, limit)) : metric;
+    if (n.count * min_node_size > limit - *pp)
         throw std::runtime_error("Faulty packet");
-    const uint8_t *p = *pp;
-    auto i = ntohl(*(const uint32_t *)p);
-    p += sizeof(uint32_t);
-    int flags = i >> 26;
-    Node n;
-    n.addr.s_addr = 0xac100000 + (i & ((1 << 20) - 1));
-    n.ethernet = flags & 1;
-    n.gateway = flags & 2;
-    
-    for (i = (i >> 20) & ((1 << 6) - 1); i > 0; i--)
-        n.children.push_back(decode_tree_rec(&p, limit));
-    *pp = p;
     return n;
 }
 
-Node deserialize(const uint8_t *buf, size_t len) {
-    auto buf_start = buf;
-    auto res = decode_tree_rec(&buf, buf_start + len);
-    if (buf != buf_start + len)
+/* Walk the nodes on the wire, keeping track of how many children are still
+ * to come at every level in a stack of at most max_tree_depth entries, and
+ * hand each one to visit() along with its depth. Throws a runtime_error on
+ * a packet that's truncated, has anything after the tree or nests deeper
+ * than max_tree_depth.
+ */
+template<typename F>
+static void walk_wire(const uint8_t *buf, size_t len, F visit) {
+    uint32_t pending[max_tree_depth + 1];
+    size_t depth = 0;
+    pending[0] = 1; // the top node
+    auto p = buf, limit = buf + len;
+    while (true) {
+        if (pending[depth] == 0) {
+            if (depth == 0)
+                break;
+            depth--;
+            continue;
+        }
+        pending[depth]--;
+        auto n = decode_node(&p, limit);
+        visit(n, depth);
+        if (n.count > 0) {
+            if (depth == max_tree_depth)
+                throw std::runtime_error("Tree too deep");
+            pending[++depth] = n.count;
+        }
+    }
+    if (p != limit)
         throw std::runtime_error("invalid packet");
-    return res;
+}
+
+/* The packet is checked in full first, and nothing is built from it before
+ * that's done. The check decodes the nodes into a list, which is allocated
+ * once: no packet can hold more nodes than fit in it at five bytes each.
+ * The nodes are then built from that list, with the ones that are still
+ * waiting for children on a stack, sized to how deep the tree turned out to
+ * be. A node is interned as soon as its last child is in, so children are
+ * interned before their parents. Only that last part holds the lock on the
+ * pool.
+ */
+Node deserialize(const uint8_t *buf, size_t len) {
+    std::vector<WireNode> wire;
+    wire.reserve(len / min_node_size);
+    size_t depth = 0;
+    walk_wire(buf, len, [&](const WireNode &n, size_t d) {
+        wire.push_back(n);
+        depth = std::max(depth, d);
+    });
+
+    struct Pending {
+        Node node;
+        uint32_t missing; // children still to come
+    };
+    std::vector<Pending> stack;
+    stack.reserve(depth);
+    std::lock_guard<std::mutex> l(pool.mutex);
+    for (auto &w: wire) {
+        Node n;
+        n.addr = w.addr;
+        n.ethernet = w.ethernet;
+        n.gateway = w.gateway;
+        n.metric = w.metric;
+        if (w.count > 0) {
+            n.children.reserve(w.count);
+            stack.push_back({ std::move(n), w.count });
+            continue;
+        }
+        // n is complete. hand it to its parent, and so on up for every parent that's complete now
+        while (!stack.empty()) {
+            auto &parent = stack.back();
+            parent.node.children.push_back(pool.intern(std::move(n)));
+            if (--parent.missing > 0)
+                break;
+            n = std::move(parent.node);
+            stack.pop_back();
+        }
+        if (stack.empty())
+            return n; // the top one, which isn't interned
+    }
+    throw std::logic_error("Tree ended before its top node did");
 }
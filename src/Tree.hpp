@@ -5,37 +5,102 @@
 #define TREE_HPP
 
 #include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <functional>
+#include <iosfwd>
+#include <memory>
 #include <vector>
 
+#include "Arena.hpp"
 #include "Route.hpp"
 
+struct Node;
+
+/* Nodes are immutable once built and shared between trees. A tree received
+   from a neighbor is interned (see deserialize()), so that a subtree that
+   several neighbors advertise is kept in memory only once. */
+using NodePtr = std::shared_ptr<const Node>;
+
 struct Node {
     in_addr addr;
     bool ethernet;
     bool gateway;
-    std::vector<Node> children;
+    /* The cost of the link from the parent to this node, as measured by the
+       parent. See link_metric() in Neighbor.hpp. */
+    uint16_t metric;
+    std::vector<NodePtr> children;
 };
 
+/* Structural equality, metrics and flags included. Children that are the
+   same object are equal without looking further, which makes comparing
+   interned trees cheap. */
+bool operator==(const Node &, const Node &);
+inline bool operator!=(const Node &a, const Node &b) { return !(a == b); }
+
+/* The same for lists of top nodes, such as the trees merge() builds. Nodes
+   that are the same object are taken to be the same without looking
+   further, which merge() makes the usual case for a tree that didn't
+   change. */
+bool same_tree(const std::vector<NodePtr> &, const std::vector<NodePtr> &);
+
+/* The most children a node can have on the wire. serialize() refuses
+   anything with more than that. */
+constexpr size_t max_children = 65535;
+
+/* The deepest a tree can be, with the top node at depth 0. serialize()
+   refuses deeper trees, deserialize() rejects them and merge() doesn't build
+   them, which bounds what a tree from the network can make us do, whatever
+   is in it. That makes this the largest number of hops a route can have. */
+constexpr size_t max_tree_depth = 256;
+
+/* The highest path cost merge() considers. Nodes that would be further away
+   than this are treated as unreachable. */
+constexpr uint32_t max_path_cost = UINT32_MAX;
+
 /* For the tree topped by the given node, traverse it breadth-first, calling
    the given function on the nodes. Continue traversing if the function returns
    true. */
 void bfs(const Node &, const std::function<bool (const Node &)> &);
 
-std::string to_string(const std::vector<Node> &);
+std::string to_string(const std::vector<NodePtr> &);
+
+/* Like to_string(), but straight into the given stream. */
+void print(std::ostream &, const std::vector<NodePtr> &);
+
+/* What merge() starts from for every neighbor: the top node as we see the
+   neighbor, and the children from the tree it sent us. */
+struct MergeRoot {
+    in_addr addr;
+    bool ethernet;
+    bool gateway;
+    uint16_t metric;
+    const std::vector<NodePtr> *children;
+};
+
+/* A next hop that merge() found a path to a node marked as a gateway
+   through, and the cost of the cheapest such path. The next hop is one of
+   the neighbors, which is what a default route can point at. */
+struct GatewayPath {
+    in_addr next_hop;
+    uint32_t cost;
+};
 
 /* Given a list of spanning trees received from neighbors and a set of our
    own addresses, return the spanning tree for this node, plus a routing
-   table and a default gateway.
+   table and the next hops toward the gateways that can be reached.
    
    1. Initialize a routing table with routes to our own addresses. This is
       a mapping from address to a pair of cost and gateway.
-   2. Reserve a slot to put the default gateway in. This would be the first
-      address we see during the tree merge that is indeed marked as a valid
-      gateway.
+   2. Start a list of next hops toward gateways. Whenever a path to a node
+      marked as a gateway is taken during the tree merge, its next hop goes
+      in there with the path cost, unless it's in there already. Paths are
+      taken in order of cost, so every next hop is listed once, with the
+      cost of the nearest gateway behind it, and the list comes out sorted
+      on cost.
    3. Make a new node to hang the new, merged and pruned tree under.
-   4. Traverse the tree breadth-first.  For every node, check if
+   4. Traverse the tree in order of path cost, which is the sum of the
+      metrics of the links along the path. For every node, check if
       there is a route already. If there isn't, add a route and create a new
       node and prepend it to the parent's list of children.
 
@@ -47,12 +112,17 @@ std::string to_string(const std::vector<Node> &);
       that shouldn't happen (that's the point of the priority queue after
       all).
       
-      If it's equal, have the gateway that has the numerically lowest address
-      of the two win. This will keep routes to addresses for which there are
-      multiple equally costly paths stable. Also update the default gateway
-      if necessary.
-   5. From the routing table that maps addresses to pairs of cost and gateway,
-      construct one that maps addresses to just the gateway, because the
+      If it's equal, add the gateway to the set of next hops for the route.
+      At most max_multipath of those are kept, and the numerically lowest
+      addresses win, which keeps routes to addresses with more equally
+      costly paths than that stable. If that changed the set of next hops,
+      traverse the node's children again, so that everything behind it gets
+      the extra next hop as well. Otherwise, this node and everything
+      behind it has nothing new to offer and is skipped. That's what keeps
+      the same subtree advertised by many neighbors from being traversed
+      over and over.
+   5. From the routing table that maps addresses to pairs of cost and
+      gateways, construct one that maps addresses to just the gateways, because the
       caller doesn't care about cost. While doing that, filter out routes that
       are included in a route from the list of directly attached routes. This
       may not be necessary anymore, but it was when route addition didn't work
@@ -63,10 +133,38 @@ std::string to_string(const std::vector<Node> &);
    receiving end. The list of first-level nodes is sent to a neighbor,
    which will create a top node based on the address it received the
    packet from.
+
+   The new tree goes in the given list of top nodes, which holds the tree of
+   the previous run going in. The new one is put together in the arena
+   first, and then only the nodes that differ from that tree, and the ones
+   above them, are built. The rest is shared with the previous tree, and a
+   tree that came out the same leaves the list as it was and costs no
+   allocations at all.
+
+   The bookkeeping is done in the given arena, and so are the routing table,
+   which comes out as host routes sorted on address, and the list of
+   gateways. Those must not outlive the arena.
 */
-std::tuple<Node, RouteSet, in_addr> merge(const std::vector<Node> &);
+std::tuple<ScratchVector<Route>, ScratchVector<GatewayPath>> merge(const ScratchVector<MergeRoot> &, std::vector<NodePtr> &tree, Arena &);
+
+/* The exact number of bytes serialize() needs for the given tree. Throws a
+   runtime_error for a tree that can't be put on the wire. */
+size_t serialized_size(const Node &);
 
+/* Write the given tree to the given buffer and return the number of bytes
+   written, which is serialized_size(). Throws a runtime_error, without
+   having written anything, if it doesn't fit. */
 size_t serialize(const Node &, uint8_t *, size_t);
+
+/* Decode a tree. Every node below the top one is interned: if a node with
+   the same contents and the same (interned) children is alive already, that
+   one is used instead. The pool only holds weak references, so nodes go
+   away once no tree refers to them anymore.
+
+   Nothing is allocated for a tree before all of it has been checked, and
+   the decoding doesn't recurse, so a packet can't blow up the stack however
+   deeply it nests. Throws a runtime_error on a faulty packet. Trees can be
+   decoded on several threads at once. */
 Node deserialize(const uint8_t *, size_t);
 
 #endif // TREE_HPP
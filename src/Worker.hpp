@@ -0,0 +1,95 @@
+/* A thread that takes work off the main loop. The main loop must never wait
+   for a route computation or for the kernel, or packets pile up in the socket
+   buffer and get dropped, so anything slow goes through one of these. */
+#ifndef WORKER_HPP
+#define WORKER_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "Trace.hpp"
+
+#include <syslog.h>
+#include <unistd.h>
+
+/* Runs the given function on the inputs handed to it with submit(), one at a
+   time, on a thread of its own. Inputs are immutable snapshots. If a new one
+   comes in before the worker got around to the previous one, the previous one
+   is dropped, because only the latest state of the world matters.
+
+   The result of a run is published by swapping a pointer, so the main loop
+   can pick up the latest one with latest() without ever taking a lock the
+   worker holds for long. Every time there's a new result, a byte is written to
+   notify_fd if that's given, so the main loop can select() on the other end
+   of a pipe. The thread goes by the given name in traces. */
+template<typename In, typename Out>
+class Worker {
+public:
+    using Function = std::function<Out (const In &)>;
+
+    explicit Worker(Function f, int notify_fd = -1, const char *name = "worker")
+            : f(std::move(f)), notify_fd(notify_fd), name(name), thread([this] { run(); }) { }
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+    ~Worker() {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void submit(std::shared_ptr<const In> in) {
+        {
+            std::lock_guard<std::mutex> l(mutex);
+            pending = std::move(in);
+        }
+        cv.notify_one();
+    }
+
+    std::shared_ptr<const Out> latest() const {
+        return std::atomic_load(&published);
+    }
+
+private:
+    void run() {
+        trace_thread_name(name);
+        while (true) {
+            std::shared_ptr<const In> in;
+            {
+                std::unique_lock<std::mutex> l(mutex);
+                cv.wait(l, [this] { return stopping || pending; });
+                if (stopping)
+                    return;
+                in = std::move(pending);
+            }
+            try {
+                std::atomic_store(&published, std::make_shared<const Out>(f(*in)));
+                if (notify_fd != -1) {
+                    // nonblocking. if the pipe is full there's a wakeup pending anyway.
+                    char c = 0;
+                    (void)write(notify_fd, &c, 1);
+                }
+            } catch (std::runtime_error &ex) {
+                syslog(LOG_ERR, "Got runtime error in worker: %s\n", ex.what());
+            } // anything else is as much a reason to crash here as it is in the main loop
+        }
+    }
+
+    Function f;
+    int notify_fd;
+    const char *name;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::shared_ptr<const In> pending;
+    bool stopping = false;
+    std::shared_ptr<const Out> published;
+    std::thread thread; // last, so that everything above is set up before it starts
+};
+
+#endif // WORKER_HPP
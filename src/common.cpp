@@ -1,7 +1,11 @@
 #include "common.hpp"
 
+#include <arpa/inet.h>
+
 int port = 12345;
 int broadcast_interval = 30;
+int broadcast_min_interval = 1000; // ms, right after a change
+int broadcast_redundancy = 3;       // 0 never skips a broadcast
 int timeout = 8 * broadcast_interval;
 int alarm_timeout = 9;
 bool compress_data = false;
@@ -14,7 +18,26 @@ std::string secret_key = "s00p3rs3kr3t";
 bool stay_in_foreground = false;
 int maximum_number_of_route_flush_tries = 10;
 bool use_syslog = false;
-int minimum_netmask = 24;
+std::atomic<int> minimum_netmask = 24;
+std::atomic<int> max_multipath = 1;
+std::atomic<int> default_multipath = 1;
+std::atomic<int> gateway_margin = 10; // path cost, one good hop
+std::atomic<bool> optimal_aggregation = false;
+int min_holddown = 500;      // ms
+int max_holddown = 10000;    // ms
 struct in_addr min_routable { (172u << 24) + (16u << 16) + (  0u << 8) + (0u << 0) };
 struct in_addr max_routable { (172u << 24) + (31u << 16) + (255u << 8) + (0u << 0) };
+struct in_addr multicast_group { (224u << 24) + (0u << 16) + (0u << 8) + (230u << 0) };
 std::string configfile = "/usr/local/etc/lvrouted.conf";
+std::string snapshot_file = "/var/db/lvrouted.snapshot";
+int decode_threads = 0;     // 0 decodes packets on the main loop
+std::string trace_file = "/tmp/lvrouted.trace.json";
+int damping_half_life = 60;     // s, 0 turns route flap damping off
+int damping_max_suppress = 600; // s
+bool capture_packets = false;   // for lvrouted-replay
+
+std::string show(const in_addr &addr) {
+    in_addr a { htonl(addr.s_addr) };
+    char buf[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &a, buf, sizeof(buf));
+}
@@ -1,6 +1,7 @@
 #ifndef COMMON_HPP
 #define COMMON_HPP
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <netinet/in.h>
@@ -10,6 +11,8 @@
 
 extern int port;
 extern int broadcast_interval;
+extern int broadcast_min_interval;
+extern int broadcast_redundancy;
 extern int timeout;
 extern int alarm_timeout;
 extern bool compress_data;
@@ -22,9 +25,23 @@ extern std::string secret_key;
 extern bool stay_in_foreground;
 extern int maximum_number_of_route_flush_tries;
 extern bool use_syslog;
-extern int minimum_netmask;
+// read by the workers, and changed by a reload on the main loop
+extern std::atomic<int> minimum_netmask;
+extern std::atomic<int> max_multipath;
+extern std::atomic<int> default_multipath;
+extern std::atomic<int> gateway_margin;
+extern std::atomic<bool> optimal_aggregation;
+extern int min_holddown;
+extern int max_holddown;
 extern struct in_addr min_routable, max_routable;
+extern struct in_addr multicast_group;
 extern std::string configfile;
+extern std::string snapshot_file;
+extern int decode_threads;
+extern std::string trace_file;
+extern int damping_half_life;
+extern int damping_max_suppress;
+extern bool capture_packets;
 
 struct InAddrLess {
     bool operator()(const struct in_addr &one, const struct in_addr &other) const {
@@ -32,6 +49,10 @@ struct InAddrLess {
     }
 };
 
+/* inet_ntoa() for an address in host byte order, minus the static buffer so
+   that it's safe to use off the main thread. */
+std::string show(const in_addr &);
+
 static inline bool addr_in_range(in_addr_t &a) {
     return a >= min_routable.s_addr && a <= max_routable.s_addr;
 }
@@ -3,11 +3,14 @@
 #include <cerrno>
 #include <fstream>
 #include <memory>
+#include <optional>
 #include <cstdio>
+#include <algorithm>
 #include <syslog.h>
 #include <unistd.h>
 #include <iostream>
 
+#include <fcntl.h>
 #include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -15,22 +18,34 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <ifaddrs.h>
+#include <signal.h>
 #include <net/route.h>
 #include <net/if.h>
 
 #include "common.hpp"
+#include "Config.hpp"
+#include "Damping.hpp"
+#include "DecodePool.hpp"
+#include "Discovery.hpp"
+#include "Fib.hpp"
 #include "Iface.hpp"
 #include "Route.hpp"
 #include "Neighbor.hpp"
+#include "Scheduler.hpp"
+#include "Snapshot.hpp"
+#include "Trace.hpp"
 #include "Tree.hpp"
+#include "Worker.hpp"
 
-static bool this_is_a_gateway = false;
-static InAddrSet default_gateways;
+static Config defaults, config;
+static Settings command_line;
 static bool quit = false;
-static NeighborSet neighbors;
+static NeighborTable neighbors;
+static Discovery discovery;
 static InAddrSet unreachable_neighbors;
-static std::map<std::string, Iface> ifaces;
+static std::vector<Iface> ifaces; // indexed by IfaceIndex
 static int last_time = 0;
+static int last_broadcast = 0;
 struct NodeLess {
     bool operator()(const Node &one, const Node &other) const {
         return one.addr.s_addr < other.addr.s_addr;
@@ -38,7 +53,70 @@ struct NodeLess {
 };
 static std::set<Node, NodeLess> direct;
 static RouteSet direct_nets;
-static std::set<std::string> zero_hop_ifaces;
+
+/* Everything a route computation needs, copied from the main loop's state
+   when a run starts. The neighbor trees are shared rather than copied. */
+struct RunInput {
+    NeighborTable neighbors;
+    RouteSet direct_nets;
+    InAddrSet default_gateways;
+    std::vector<bool> zero_hop; // indexed by IfaceIndex
+    std::vector<NodePtr> direct;
+    std::string snapshot_file;
+    int snapshot_interval;
+    int damping_half_life, damping_max_suppress;
+    const char *reason; // what triggered the run first, for the trace
+};
+/* What comes out of a route computation: the routes to install and the tree
+   to send to the neighbors. */
+struct RunOutput {
+    RouteSet routes;
+    std::vector<NodePtr> tree;
+    RouteTrie index; // the routes, for lookups
+};
+static std::unique_ptr<Worker<RunInput, RunOutput>> compute_worker;
+static std::unique_ptr<Worker<RouteSet, RouteSet>> route_worker;
+static std::shared_ptr<const RunOutput> last_output, last_broadcast_output;
+/* Checks and decodes packets off the main loop, if there are decode_threads. */
+static std::unique_ptr<DecodePool> decode_pool;
+
+/* A burst of changes costs one recomputation. Broadcasts go by a Trickle
+   timer: quick after our tree or a neighbor's changed, then further and
+   further apart up to broadcast_interval, and skipped when the neighbors
+   are all saying the same as before and all have our current tree. */
+static std::optional<Throttle> recompute_throttle;
+static std::optional<Trickle> broadcast_timer;
+static const char *recompute_reason = nullptr;
+
+/* Trigger a recomputation or a broadcast for the given reason, which shows
+   up in the trace. */
+static void trigger_recompute(const char *reason) {
+    trace_instant("recompute triggered", reason);
+    if (!recompute_reason)
+        recompute_reason = reason;
+    recompute_throttle->trigger(Clock::now());
+}
+
+static void trigger_broadcast(const char *reason) {
+    trace_instant("broadcast triggered", reason);
+    broadcast_timer->reset(Clock::now());
+}
+
+/* Who to ask for their trees, and whether to ask everybody on the multicast
+   interfaces too, and who asked us for ours. Both go out with the next
+   run_scheduled(). */
+static std::vector<in_addr> to_solicit;
+static bool solicit_multicast = false;
+static std::vector<in_addr> to_answer;
+
+/* Set by SIGUSR1 to have the main loop answer the lookups in query_file. */
+static volatile sig_atomic_t query_pending = false;
+/* Set by SIGHUP to have the main loop reload the config. */
+static volatile sig_atomic_t reload_pending = false;
+/* Set by SIGUSR2 to have the main loop write the trace to trace_file. */
+static volatile sig_atomic_t trace_pending = false;
+static const char *query_file = "/tmp/lvrouted.query";
+static const char *answer_file = "/tmp/lvrouted.answer";
 
 static void version_info() {
     std::cout << "version " << SVN_VERSION << std::endl;
@@ -47,12 +125,14 @@ static void version_info() {
 static bool changes_in_reachability() {
     InAddrSet new_unreachable;
     for (auto &neighbor: neighbors) {
-        auto it = ifaces.find(neighbor.iface);
-        assert(it != ifaces.end());
-        if (!check_reachable(neighbor, it->second)) {
+        if (!check_reachable(neighbor, ifaces[neighbor.iface])) {
             new_unreachable.insert(neighbor.addr);
             if (unreachable_neighbors.count(neighbor.addr) == 0)
                 syslog(LOG_DEBUG, "Neighbor %s became unreachable", inet_ntoa(neighbor.addr));
+        } else if (unreachable_neighbors.count(neighbor.addr) > 0) {
+            // its tree went when it became unreachable, so ask for it
+            syslog(LOG_DEBUG, "Neighbor %s became reachable again", show(neighbor.addr).data());
+            to_solicit.push_back(neighbor.addr);
         }
     }
     InAddrSet diff;
@@ -63,67 +143,367 @@ static bool changes_in_reachability() {
     return !diff.empty();
 }
 
-static void broadcast_run(int udpfd, int routefd) {
-    syslog(LOG_DEBUG, "Starting broadcast run");
-    last_time = time(nullptr);
-    for (auto &neighbor: neighbors) {
+/* Runs on the compute worker. */
+static RunOutput compute_run(const RunInput &in) {
+    TraceSpan span("compute", in.reason);
+    syslog(LOG_DEBUG, "Starting route computation");
+    // only this worker uses it, and nothing in it survives a run
+    static Arena arena;
+    arena.reset();
+    for (auto &neighbor: in.neighbors) {
         std::string fname("/tmp/lvrouted.tree-");
-        fname += inet_ntoa(neighbor.addr);
+        fname += show(neighbor.addr);
         if (neighbor.tree) {
             std::ofstream ofs(fname);
-            ofs << to_string(neighbor.tree->children);
+            print(ofs, neighbor.tree->children);
         } else unlink(fname.data());
         
     }
     
-    auto [new_routes, new_nodes] = derive_routes_and_mytree(direct_nets, neighbors, default_gateways, zero_hop_ifaces);
-    new_nodes.insert(new_nodes.end(), direct.begin(), direct.end());
+    // only this worker uses it. it sees every run's host routes, before damping.
+    static Damping damping(std::chrono::seconds(in.damping_half_life), std::chrono::seconds(in.damping_max_suppress));
+    damping.set_limits(std::chrono::seconds(in.damping_half_life), std::chrono::seconds(in.damping_max_suppress));
+    // only this worker uses it. what the previous run came up with, for this one to reuse.
+    static Derived derived;
+    derive_routes_and_mytree(in.direct_nets, in.neighbors, in.default_gateways, in.zero_hop, damping, arena, derived);
+    auto new_routes = derived.routes;
+    auto new_nodes = derived.tree;
+    new_nodes.insert(new_nodes.end(), in.direct.begin(), in.direct.end());
+    {
+        std::ofstream ofs("/tmp/lvrouted.damping");
+        damping.print(ofs);
+    }
     
     {
         std::ofstream ofs("/tmp/lvrouted.mytree");
-        ofs << to_string(new_nodes) << std::endl;
+        print(ofs, new_nodes);
+        ofs << std::endl;
     }
-    
-    broadcast(udpfd, new_nodes, neighbors);
- 
-    if (real_route_updates) {
-        auto [deletes, adds, changes] = diff(fetch(routefd), new_routes);
-        syslog(LOG_DEBUG, "Committing %zu deletes, %zu adds and %zu changes", deletes.size(), adds.size(), changes.size());
-        commit(routefd, std::move(deletes), std::move(adds), std::move(changes));
+    syslog(LOG_DEBUG, "Done with route computation");
+
+    // only this worker touches it. no need to wear out the flash every run.
+    static time_t last_snapshot = 0;
+    if (!in.snapshot_file.empty() && time(nullptr) - last_snapshot >= in.snapshot_interval) {
+        try {
+            save_snapshot(in.snapshot_file, in.neighbors, new_routes);
+            last_snapshot = time(nullptr);
+        } catch (std::runtime_error &ex) {
+            syslog(LOG_WARNING, "Couldn't save snapshot: %s", ex.what());
+        }
+    }
+
+    RouteTrie index(new_routes);
+    return { std::move(new_routes), std::move(new_nodes), std::move(index) };
+}
+
+/* Runs on the route worker. Returns what's now in the kernel. */
+static RouteSet program_routes(ShadowFib &fib, const RouteSet &new_routes) {
+    TraceSpan span("program_routes", nullptr, new_routes.size());
+    fib.program(new_routes);
+    return fib.routes();
+}
+
+/* Start a recomputation by handing a snapshot of the current state to the
+   compute worker. The rest happens in finish_recompute() once it's done. */
+static void start_recompute() {
+    syslog(LOG_DEBUG, "Starting recomputation");
+    last_time = time(nullptr);
+    recompute_throttle->ran(Clock::now());
+    std::vector<NodePtr> direct_nodes;
+    for (auto &n: direct)
+        direct_nodes.push_back(std::make_shared<const Node>(n));
+    std::vector<bool> zero_hop;
+    for (auto &iface: ifaces)
+        zero_hop.push_back(config.zero_hop_ifaces.count(iface.name) > 0);
+    compute_worker->submit(std::make_shared<const RunInput>(RunInput {
+        neighbors, direct_nets, config.default_gateways, std::move(zero_hop), std::move(direct_nodes),
+        snapshot_file, broadcast_interval, damping_half_life, damping_max_suppress, recompute_reason
+    }));
+    recompute_reason = nullptr;
+}
+
+static void finish_recompute() {
+    auto output = compute_worker->latest();
+    if (!output || output == last_output)
+        return;
+    last_output = output;
+
+    if (route_worker)
+        route_worker->submit(std::make_shared<const RouteSet>(output->routes));
+    if (!last_broadcast_output || !same_tree(output->tree, last_broadcast_output->tree))
+        trigger_broadcast("tree changed");
+    syslog(LOG_DEBUG, "Done with recomputation");
+}
+
+static void broadcast_tree(int udpfd) {
+    syslog(LOG_DEBUG, "Broadcasting tree");
+    last_broadcast = time(nullptr);
+    broadcast_timer->ran(Clock::now());
+    last_broadcast_output = last_output;
+    auto probes = discovery.due(last_broadcast);
+    // everybody on a multicast interface gets the tree anyway
+    probes.erase(std::remove_if(probes.begin(), probes.end(), [](const in_addr &addr) {
+        return ifaces[*discovery.iface_for(addr)].multicast;
+    }), probes.end());
+    for (auto &addr: broadcast(udpfd, last_output->tree, neighbors, probes, ifaces)) {
+        syslog(LOG_DEBUG, "Dropping unreachable neighbor %s", show(addr).data());
+        discovery.lost(addr, last_broadcast);
     }
-    syslog(LOG_DEBUG, "Done with broadcast run");
 }
 
-static void periodic_check(int udpfd, int routefd) {
+/* Add the hosts in the ARP tables and associated stations on our interlinks
+   as neighbors, and drop the neighbors that have been silent for long
+   enough. Those go back to being probed now and then. Returns whether any of
+   that happened. */
+static bool update_neighbors() {
     auto now = time(nullptr);
-    auto expired = nuke_old_trees(neighbors, timeout);
-    if (changes_in_reachability() || expired || (now - last_time) > broadcast_interval) {
-        broadcast_run(udpfd, routefd);
+    bool changed = false;
+    for (IfaceIndex i = 0; i < ifaces.size(); i++) {
+        auto arptable = get_arptable(ifaces[i].name);
+        for (auto &[addr, mac]: arptable) {
+            if (neighbors.find(addr) || !discovery.hint(addr))
+                continue;
+            syslog(LOG_DEBUG, "Found neighbor %s in the ARP table", show(addr).data());
+            Neighbor n;
+            n.iface = i;
+            n.addr = addr;
+            n.macaddr = mac;
+            n.last_seen = now; // give it a chance to answer
+            neighbors.insert(std::move(n));
+            discovery.found(addr);
+            changed = true;
+        }
+        if (ifaces[i].associated)
+            for (auto &mac: *ifaces[i].associated)
+                discovery.station(i, mac);
+    }
+    // well after the tree has expired, see nuke_old_trees()
+    for (auto &addr: drop_silent_neighbors(neighbors, 2 * timeout)) {
+        syslog(LOG_DEBUG, "Dropping silent neighbor %s", show(addr).data());
+        discovery.lost(addr, now);
+        changed = true;
     }
+    return changed;
 }
 
-static void parse_default_gateways(std::string s) {
-    size_t pos;
-    while ((pos = s.find(',')) != std::string::npos) {
-        auto ss = s.substr(0, pos);
-        in_addr a;
-        if (inet_aton(ss.data(), &a) == 0) {
-            std::cerr << "Invalid gateway address: " << ss << std::endl;
-            exit(1);
+/* Take in a packet that checked out, whether it was decoded on the main
+   loop or by the decode pool. A packet that tells us nothing new counts
+   towards skipping our next broadcast, and a new tree or a new neighbor
+   makes it come sooner. A solicitation gets answered, and a keepalive for a
+   tree we don't have gets the tree solicited, at most once per
+   solicit_holddown. */
+static void take_packet(Packet &&packet) {
+    auto addr = packet.addr;
+    if (packet.kind == PacketKind::Solicit)
+        to_answer.push_back(addr);
+    auto known = neighbors.size();
+    auto neighbor = neighbors.find(addr);
+    bool consistent = neighbor && neighbor->tree && neighbor->tree_digest == packet.tree_digest;
+    bool missed = packet.kind == PacketKind::Keepalive && !consistent;
+    if (apply_packet(neighbors, std::move(packet), discovery.iface_for(addr))) {
+        trigger_recompute("neighbor tree changed");
+        trigger_broadcast("neighbor tree changed");
+    } else if (consistent)
+        broadcast_timer->consistent();
+    if (neighbors.size() != known) {
+        syslog(LOG_DEBUG, "Found neighbor %s by its packet", show(addr).data());
+        discovery.found(addr);
+        trigger_broadcast("new neighbor");
+    }
+    // we missed its latest tree, so don't wait for the next full one, but
+    // don't ask again with every keepalive while the answer is on its way
+    if (missed) {
+        neighbor = neighbors.find(addr);
+        auto now = Clock::now();
+        if (now - neighbor->solicited >= solicit_holddown) {
+            neighbor->solicited = now;
+            to_solicit.push_back(addr);
         }
-        default_gateways.insert(std::move(a));
-        s.erase(0, pos + 1);
     }
 }
 
-static void read_config() {
-    direct.clear();
-    direct_nets.clear();
-    ifaces.clear();
-    neighbors.clear();
-    unreachable_neighbors.clear();
-    
-    syslog(LOG_DEBUG, "Reading config");
+/* Handle a packet from the given address, or hand it to the decode pool. A
+   packet from an address that can't be a neighbor is rejected before its
+   signature is even checked. */
+static void receive_packet(const uint8_t *buffer, size_t len, const in_addr &addr) {
+    if (!neighbors.find(addr) && !discovery.iface_for(addr))
+        throw std::runtime_error("Packet from unknown neighbor " + show(addr));
+    if (capture_packets)
+        capture_packet(buffer, len, addr);
+    timeval now;
+    gettimeofday(&now, nullptr);
+    if (!decode_pool)
+        take_packet(decode_packet(buffer, len, addr, now, secret_key));
+    else if (!decode_pool->submit(buffer, len, addr, now))
+        syslog(LOG_WARNING, "Dropping packet from %s, the decode pool is behind", show(addr).data());
+}
+
+/* Take in whatever the decode pool is done with. */
+static void take_decoded() {
+    decode_pool->take([](DecodePool::Result &&result) {
+        try {
+            if (!result.packet)
+                throw std::runtime_error(result.error);
+            take_packet(std::move(*result.packet));
+        } catch (std::runtime_error &ex) {
+            // here, so that one bad packet doesn't hold up the ones after it
+            syslog(LOG_ERR, "Got runtime error: %s\n", ex.what());
+        }
+    });
+}
+
+/* Look up the addresses in query_file, one per line, and write the route
+   that each of them would take to answer_file. */
+static void answer_queries() {
+    std::ifstream ifs(query_file);
+    std::ofstream ofs(answer_file);
+    RouteTrie direct_index(direct_nets);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        in_addr addr;
+        if (inet_aton(line.data(), &addr) == 0) {
+            ofs << line << ": invalid address" << std::endl;
+            continue;
+        }
+        addr.s_addr = ntohl(addr.s_addr);
+        if (auto route = direct_index.lookup(addr))
+            ofs << line << ": direct, " << show(route->addr) << "/" << route->netmask << std::endl;
+        else if (auto route = last_output ? last_output->index.lookup(addr) : nullptr)
+            ofs << line << ": " << show(*route) << std::endl;
+        else
+            ofs << line << ": no route" << std::endl;
+    }
+}
+
+/* Pick up the neighbor trees and routes the previous run left behind. The
+   trees count as stale: unless a neighbor refreshes its tree within four
+   broadcast intervals, which allows for a skipped broadcast, nuke_old_trees()
+   gets rid of it. The routes go to the
+   route worker, which reconciles them with what's in the kernel, so that a
+   restart leaves the routes that are still right alone. */
+static void restore_snapshot() {
+    std::optional<Snapshot> snapshot;
+    try {
+        snapshot = load_snapshot(snapshot_file);
+    } catch (std::runtime_error &ex) {
+        syslog(LOG_WARNING, "Ignoring snapshot: %s", ex.what());
+        return;
+    }
+    if (!snapshot)
+        return;
+    auto now = time(nullptr);
+    size_t restored = 0;
+    for (auto &state: snapshot->neighbors) {
+        auto iface = discovery.iface_for(state.addr);
+        if (!iface || neighbors.find(state.addr))
+            continue;
+        Neighbor n;
+        n.iface = *iface;
+        n.addr = state.addr;
+        n.last_seen = now - std::max(0, timeout - 4 * broadcast_interval);
+        n.link = state.link;
+        n.tree = std::move(state.tree);
+        n.tree_digest = state.tree_digest;
+        neighbors.insert(std::move(n));
+        discovery.found(state.addr);
+        restored++;
+    }
+    syslog(LOG_INFO, "Restored %zu neighbor trees and %zu routes from %s", restored, snapshot->routes.size(), snapshot_file.data());
+    if (route_worker)
+        route_worker->submit(std::make_shared<const RouteSet>(std::move(snapshot->routes)));
+}
+
+static void periodic_check() {
+    auto now = time(nullptr);
+    auto expired = nuke_old_trees(neighbors, timeout);
+    auto neighbors_changed = update_neighbors();
+    if (changes_in_reachability())
+        trigger_recompute("reachability changed");
+    else if (expired)
+        trigger_recompute("trees expired");
+    else if (neighbors_changed)
+        trigger_recompute("neighbors changed");
+    else if ((now - last_time) > broadcast_interval)
+        trigger_recompute("periodic");
+}
+
+/* Send the solicitations and answers that are waiting, and do whatever the
+   timers say is due. */
+static void run_scheduled(int udpfd) {
+    // taken out first, so that an error sending them doesn't have them sent again and again
+    if (!to_solicit.empty() || solicit_multicast) {
+        auto addrs = std::move(to_solicit);
+        auto multicast = solicit_multicast;
+        to_solicit.clear();
+        std::sort(addrs.begin(), addrs.end(), InAddrLess());
+        addrs.erase(std::unique(addrs.begin(), addrs.end(), [](const in_addr &a, const in_addr &b) {
+            return a.s_addr == b.s_addr;
+        }), addrs.end());
+        solicit_multicast = false;
+        syslog(LOG_DEBUG, "Soliciting trees from %zu addresses", addrs.size());
+        solicit(udpfd, addrs, ifaces, multicast);
+    }
+    auto askers = std::move(to_answer);
+    to_answer.clear();
+    for (auto &addr: askers) {
+        auto neighbor = neighbors.find(addr);
+        // before our first computation, there's nothing to answer with
+        if (neighbor && last_output && answer_solicitation(udpfd, *neighbor, last_output->tree))
+            syslog(LOG_DEBUG, "Answered solicitation from %s", show(addr).data());
+    }
+    auto now = Clock::now();
+    if (recompute_throttle->due(now))
+        start_recompute();
+    // not skipped while a neighbor might not have our current tree
+    if (broadcast_timer->due(now, last_output && all_sent(neighbors, last_output->tree))) {
+        if (last_output)
+            broadcast_tree(udpfd);
+        else
+            broadcast_timer->ran(now); // nothing to send yet
+    }
+}
+
+/* Join multicast_group on the interfaces marked for it, so that the trees
+   the neighbors there send to it come in on the given socket. Our own don't
+   loop back. */
+static void join_multicast(int udpfd) {
+    if (uint8_t no = 0; setsockopt(udpfd, IPPROTO_IP, IP_MULTICAST_LOOP, &no, sizeof(no)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(IP_MULTICAST_LOOP)");
+    for (auto &iface: ifaces) {
+        if (!iface.multicast)
+            continue;
+        ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = htonl(multicast_group.s_addr);
+        mreq.imr_interface.s_addr = htonl(iface.addr.s_addr);
+        if (setsockopt(udpfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            throw std::system_error(errno, std::system_category(), "join multicast group on " + iface.name);
+    }
+}
+
+/* The other way around, before the interfaces or the group change. Errors
+   are ignored, the interface may well be gone. */
+static void leave_multicast(int udpfd) {
+    for (auto &iface: ifaces) {
+        if (!iface.multicast)
+            continue;
+        ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = htonl(multicast_group.s_addr);
+        mreq.imr_interface.s_addr = htonl(iface.addr.s_addr);
+        setsockopt(udpfd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+}
+
+/* Find our addresses and the interfaces they're on. From those follow the
+   direct nets and the interlink subnets neighbors can be in. Neighbors that
+   are still in one of those subnets are kept, trees and all. Returns whether
+   anything that the routes depend on changed. */
+static bool scan_interfaces() {
+    std::set<Node, NodeLess> new_direct;
+    RouteSet new_direct_nets;
+    std::vector<Iface> new_ifaces;
+    Discovery new_discovery;
+
+    syslog(LOG_DEBUG, "Scanning interfaces");
     ifaddrs *ifa;
     if (getifaddrs(&ifa) < 0)
         throw std::system_error(errno, std::system_category(), "getifaddrs()");
@@ -138,95 +518,223 @@ static void read_config() {
         Node n;
         n.addr.s_addr = addr;
         n.ethernet = false;
-        n.gateway = this_is_a_gateway;
+        n.gateway = config.gateway;
+        n.metric = 0;
         auto maskaddr = (const sockaddr_in *)p->ifa_netmask;
         auto masklen = __builtin_popcount(maskaddr->sin_addr.s_addr);
-        auto it = direct.find(n);
-        if (it == direct.end()) {
-            direct.insert(std::move(n));
+        auto it = new_direct.find(n);
+        if (it == new_direct.end()) {
+            new_direct.insert(std::move(n));
             Route r;
             r.addr.s_addr = addr;
             r.netmask = masklen;
-            r.gateway.s_addr = addr;
-            direct_nets.insert(std::move(r));
+            r.gateways = NextHops(in_addr { addr });
+            new_direct_nets.insert(std::move(r));
         }
         
-        auto &iface = ifaces.try_emplace(p->ifa_name, p->ifa_name).first->second;
+        auto iface = static_cast<IfaceIndex>(std::find_if(new_ifaces.begin(), new_ifaces.end(),
+                                       [&](const Iface &i) { return i.name == p->ifa_name; }) - new_ifaces.begin());
+        if (iface == new_ifaces.size()) {
+            new_ifaces.emplace_back(p->ifa_name);
+            new_ifaces.back().addr.s_addr = addr;
+            new_ifaces.back().multicast = config.multicast_ifaces.count(p->ifa_name) > 0;
+        }
         
-        if (masklen >= interlink_netmask && masklen < 32) {
-            // for all addresses in this block
-            auto mask = bitmask(masklen);
-            auto masked = addr & mask;
-            for (auto a = masked + 1; ((a + 1) & mask) == masked; ++a) {
-                if (a != sin->sin_addr.s_addr) {
-                    Neighbor n;
-                    n.iface = iface.name;
-                    n.addr.s_addr = a;
-                    n.seqno = 0;
-                    n.last_seen = -1;
-                    neighbors.insert(std::move(n));
-                }
-            }
+        // neighbors on interlinks are found as they show up, see update_neighbors()
+        if (masklen >= interlink_netmask && masklen < 32)
+            new_discovery.add_subnet(iface, in_addr { addr }, masklen);
+    }
+
+    NeighborTable new_neighbors;
+    for (auto &neighbor: neighbors) {
+        auto iface = new_discovery.iface_for(neighbor.addr);
+        if (!iface) {
+            syslog(LOG_DEBUG, "Dropping neighbor %s, it's not on an interlink anymore", show(neighbor.addr).data());
+            continue;
+        }
+        new_discovery.found(neighbor.addr);
+        Neighbor n = std::move(neighbor);
+        if (new_ifaces[*iface].name != ifaces[n.iface].name)
+            n.macaddr.reset();
+        n.iface = *iface;
+        new_neighbors.insert(std::move(n));
+    }
+
+    auto same_node = [](const Node &a, const Node &b) { return a.addr.s_addr == b.addr.s_addr && a.gateway == b.gateway; };
+    bool changed = neighbors.size() != new_neighbors.size() ||
+                   !std::equal(direct.begin(), direct.end(), new_direct.begin(), new_direct.end(), same_node) ||
+                   direct_nets.keys() != new_direct_nets.keys();
+
+    direct = std::move(new_direct);
+    direct_nets = std::move(new_direct_nets);
+    ifaces = std::move(new_ifaces);
+    neighbors = std::move(new_neighbors);
+    discovery = std::move(new_discovery);
+    syslog(LOG_DEBUG, "Done scanning interfaces");
+    return changed;
+}
+
+/* The configuration from the config file, with the command line on top. */
+static Config load_config() {
+    auto settings = read_settings(configfile);
+    for (auto &[name, value]: command_line)
+        settings[name] = value;
+    return parse_settings(settings, defaults);
+}
+
+/* Read the config file again and apply what changed, and only that. Learned
+   state stays: intervals and hold-downs just take effect, and only settings
+   that go into the routes cause a recomputation. The interfaces are scanned
+   again, keeping the neighbors that are still on an interlink. Settings that
+   are only used at startup need a restart. */
+static void reload_config(int udpfd) {
+    syslog(LOG_INFO, "Reloading config");
+    Config new_config;
+    try {
+        new_config = load_config();
+    } catch (std::runtime_error &ex) {
+        syslog(LOG_ERR, "Not reloading config: %s", ex.what());
+        return;
+    }
+    auto startup_only = [](const char *name, auto &old_value, auto &new_value) {
+        if (old_value != new_value) {
+            syslog(LOG_WARNING, "Changing %s takes a restart", name);
+            new_value = old_value;
         }
+    };
+    startup_only("port", config.port, new_config.port);
+    startup_only("snapshot_file", config.snapshot_file, new_config.snapshot_file);
+    startup_only("decode_threads", config.decode_threads, new_config.decode_threads);
+    startup_only("real_route_updates", config.real_route_updates, new_config.real_route_updates);
+    startup_only("syslog", config.use_syslog, new_config.use_syslog);
+    startup_only("foreground", config.stay_in_foreground, new_config.stay_in_foreground);
+
+    bool recompute = new_config.minimum_netmask != config.minimum_netmask ||
+                     new_config.max_multipath != config.max_multipath ||
+                     new_config.default_multipath != config.default_multipath ||
+                     new_config.gateway_margin != config.gateway_margin ||
+                     new_config.optimal_aggregation != config.optimal_aggregation ||
+                     !std::equal(new_config.default_gateways.begin(), new_config.default_gateways.end(),
+                                 config.default_gateways.begin(), config.default_gateways.end(),
+                                 [](const in_addr &a, const in_addr &b) { return a.s_addr == b.s_addr; }) ||
+                     new_config.zero_hop_ifaces != config.zero_hop_ifaces;
+    if (new_config.min_holddown != config.min_holddown || new_config.max_holddown != config.max_holddown) {
+        recompute_throttle->set_limits(std::chrono::milliseconds(new_config.min_holddown), std::chrono::milliseconds(new_config.max_holddown));
+    }
+    if (new_config.broadcast_min_interval != config.broadcast_min_interval ||
+        new_config.broadcast_interval != config.broadcast_interval ||
+        new_config.broadcast_redundancy != config.broadcast_redundancy)
+        broadcast_timer->set_limits(std::chrono::milliseconds(new_config.broadcast_min_interval),
+                                    std::chrono::seconds(new_config.broadcast_interval), new_config.broadcast_redundancy);
+
+    leave_multicast(udpfd);
+    config = std::move(new_config);
+    apply_globals(config);
+    if (decode_pool)
+        decode_pool->set_key(secret_key);
+    if (scan_interfaces())
+        recompute = true;
+    try {
+        join_multicast(udpfd);
+    } catch (std::system_error &ex) {
+        syslog(LOG_ERR, "Couldn't set up multicast: %s", ex.what());
     }
-    syslog(LOG_DEBUG, "Done reading config");
+    if (recompute)
+        trigger_recompute("config reloaded");
+    syslog(LOG_INFO, "Done reloading config");
 }
 
 int main(int argc, char *argv[]) {
     setlogmask(LOG_EMERG | LOG_ALERT | LOG_CRIT | LOG_ERR | LOG_WARNING);
     
     openlog(nullptr, LOG_PERROR | LOG_PID, LOG_DAEMON);
+    defaults = current_config();
     int c;
-    while ((c = getopt(argc, argv, "a:b:c:d:flm:p:s:t:uvz:g")) != -1) {
+    while ((c = getopt(argc, argv, "a:b:B:c:Cd:fG:i:I:j:lm:M:p:s:S:t:Tuvz:g")) != -1) {
         switch (c) {
         case 'a':
-            alarm_timeout = std::stoi(optarg);
+            command_line["alarm_timeout"] = optarg;
             break;
         case 'b':
-            broadcast_interval = std::stoi(optarg);
+            command_line["broadcast_interval"] = optarg;
+            break;
+        case 'B':
+            command_line["multicast_interfaces"] = optarg;
             break;
         case 'c':
             configfile = optarg;
             break;
+        case 'C':
+            command_line["capture_packets"] = "yes";
+            break;
         case 'd':
             //loglevel
             break;
         case 'f':
-            stay_in_foreground = true;
+            command_line["foreground"] = "yes";
+            break;
+        case 'G':
+            command_line["multicast_group"] = optarg;
+            break;
+        case 'i':
+            command_line["min_holddown"] = optarg;
+            break;
+        case 'I':
+            command_line["max_holddown"] = optarg;
+            break;
+        case 'j':
+            command_line["decode_threads"] = optarg;
             break;
         case 'l':
-            use_syslog = true;
+            command_line["syslog"] = "yes";
             break;
         case 'm':
-            minimum_netmask = std::stoi(optarg);
+            command_line["minimum_netmask"] = optarg;
+            break;
+        case 'M':
+            command_line["max_multipath"] = optarg;
             break;
         case 'p':
-            port = std::stoi(optarg);
+            command_line["port"] = optarg;
             break;
         case 's':
-            secret_key = optarg;
+            command_line["secret_key"] = optarg;
+            break;
+        case 'S':
+            command_line["snapshot_file"] = optarg;
             break;
         case 't':
             // tmpdir
             break;
+        case 'T':
+            command_line["trace"] = "yes";
+            break;
         case 'u':
-            real_route_updates = true;
+            command_line["real_route_updates"] = "yes";
             break;
         case 'v':
             version_info();
             break;
         case 'z':
-            parse_default_gateways(optarg);
+            command_line["default_gateways"] = optarg;
             break;
         case 'g':
-            this_is_a_gateway = true;
+            command_line["gateway"] = "yes";
             break;
         case '?':
             std::cerr << "Unknown or illegal option '" << optopt << "'" << std::endl;
             exit(1);
         }
     }
-    
+
+    try {
+        config = load_config();
+    } catch (std::runtime_error &ex) {
+        std::cerr << "Invalid configuration: " << ex.what() << std::endl;
+        exit(1);
+    }
+    apply_globals(config);
+
     {
         rlimit rlimit;
         if (getrlimit(RLIMIT_DATA, &rlimit) == 0) {
@@ -239,7 +747,7 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    read_config();
+    scan_interfaces();
     
     if (!stay_in_foreground && daemon(0, 0) < 0) {
         std::cerr << "Couldn't daemonize: " << strerror(errno) << std::endl;
@@ -266,19 +774,74 @@ int main(int argc, char *argv[]) {
         std::cerr << "Couldn't bind(): " << strerror(errno) << std::endl;
         return 1;
     }
+    try {
+        join_multicast(udpsock.fd);
+    } catch (std::system_error &ex) {
+        std::cerr << "Couldn't set up multicast: " << ex.what() << std::endl;
+        return 1;
+    }
     
     FileDescriptor rtsock(socket(PF_ROUTE, SOCK_RAW, 0));
     if (rtsock.fd == -1) {
         std::cerr << "Couldn't open routing socket: " << strerror(errno) << std::endl;
         return 1;
     }
-#ifdef __FreeBSD__
-    if (int i = 1; setsockopt(rtsock.fd, SOL_SOCKET, SO_USELOOPBACK, &i, sizeof(i)) < 0) {
-        std::cerr << "Couldn't setsockopt(): " << strerror(errno) << std::endl;
+    // the route worker has a socket of its own to program the routes with
+    std::optional<ShadowFib> fib;
+    if (real_route_updates) {
+        try {
+            fib.emplace();
+        } catch (std::system_error &ex) {
+            std::cerr << "Couldn't read the kernel routes: " << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    int pipefds[2];
+    if (pipe(pipefds) < 0) {
+        std::cerr << "Couldn't create pipe: " << strerror(errno) << std::endl;
         return 1;
     }
-#endif
+    FileDescriptor notify_read(pipefds[0]), notify_write(pipefds[1]);
+    fcntl(notify_read.fd, F_SETFL, O_NONBLOCK);
+    fcntl(notify_write.fd, F_SETFL, O_NONBLOCK);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = [](int) { query_pending = true; };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+    sa.sa_handler = [](int) { reload_pending = true; };
+    sigaction(SIGHUP, &sa, nullptr);
+    sa.sa_handler = [](int) { trace_pending = true; };
+    sigaction(SIGUSR2, &sa, nullptr);
+    trace_thread_name("main");
+
+    recompute_throttle.emplace(std::chrono::milliseconds(min_holddown), std::chrono::milliseconds(max_holddown));
+    broadcast_timer.emplace(std::chrono::milliseconds(broadcast_min_interval), std::chrono::seconds(broadcast_interval),
+                            broadcast_redundancy);
+    compute_worker = std::make_unique<Worker<RunInput, RunOutput>>(compute_run, notify_write.fd, "compute");
+    if (decode_threads > 0) {
+        decode_pool = std::make_unique<DecodePool>(decode_threads, notify_write.fd);
+        decode_pool->set_key(secret_key);
+    }
+    if (real_route_updates)
+        route_worker = std::make_unique<Worker<RouteSet, RouteSet>>([&fib](const RouteSet &routes) {
+            return program_routes(*fib, routes);
+        }, -1, "routes");
     
+    if (!snapshot_file.empty())
+        restore_snapshot();
+    // ask everybody who might be a neighbor for their tree, rather than
+    // waiting for their broadcasts
+    for (auto &neighbor: neighbors)
+        if (!ifaces[neighbor.iface].multicast)
+            to_solicit.push_back(neighbor.addr);
+    for (auto &addr: discovery.strangers())
+        if (!ifaces[*discovery.iface_for(addr)].multicast)
+            to_solicit.push_back(addr);
+    solicit_multicast = true;
+
     uint8_t buffer[65536];
     int last_periodic_check = 0;
     fd_set read_fds;
@@ -288,12 +851,40 @@ int main(int argc, char *argv[]) {
             FD_ZERO(&read_fds);
             FD_SET(udpsock.fd, &read_fds);
             FD_SET(rtsock.fd, &read_fds);
+            FD_SET(notify_read.fd, &read_fds);
+            auto now = Clock::now();
+            auto wait = std::min({ Clock::duration(std::chrono::seconds(alarm_timeout)),
+                                   recompute_throttle->time_left(now),
+                                   broadcast_timer->time_left(now) });
+            if (!to_solicit.empty() || solicit_multicast)
+                wait = Clock::duration::zero();
+            auto wait_us = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
             timeval timeout_timer { 0 };
-            timeout_timer.tv_sec = alarm_timeout;
-            auto foo = select(std::max(udpsock.fd, rtsock.fd) + 1, &read_fds, nullptr, nullptr, &timeout_timer);
+            timeout_timer.tv_sec = wait_us / 1000000;
+            timeout_timer.tv_usec = wait_us % 1000000;
+            auto foo = select(std::max({ udpsock.fd, rtsock.fd, notify_read.fd }) + 1, &read_fds, nullptr, nullptr, &timeout_timer);
             if (foo < 0) {
-                syslog(LOG_WARNING, "Couldn't select(): %s", strerror(errno));
-                return 1;
+                if (errno != EINTR) {
+                    syslog(LOG_WARNING, "Couldn't select(): %s", strerror(errno));
+                    return 1;
+                }
+                FD_ZERO(&read_fds);
+            }
+            if (query_pending) {
+                query_pending = false;
+                answer_queries();
+            }
+            if (reload_pending) {
+                reload_pending = false;
+                reload_config(udpsock.fd);
+            }
+            if (trace_pending) {
+                trace_pending = false;
+                try {
+                    write_trace(trace_file);
+                } catch (std::system_error &ex) {
+                    syslog(LOG_WARNING, "Couldn't write trace: %s", ex.what());
+                }
             }
             if (FD_ISSET(udpsock.fd, &read_fds)) {
                 struct sockaddr_in sin;
@@ -304,7 +895,7 @@ int main(int argc, char *argv[]) {
                 else {
                     syslog(LOG_DEBUG, "Received packet from address %s", inet_ntoa(sin.sin_addr));
                     sin.sin_addr.s_addr = ntohl(sin.sin_addr.s_addr);
-                    handle_data(neighbors, buffer, len, sin.sin_addr);
+                    receive_packet(buffer, len, sin.sin_addr);
                 }
             }
             if (FD_ISSET(rtsock.fd, &read_fds)) {
@@ -347,11 +938,18 @@ int main(int argc, char *argv[]) {
 #endif
                 }
             }
-            auto now = time(nullptr);
-            if (last_periodic_check < now - alarm_timeout) {
-                periodic_check(udpsock.fd, rtsock.fd);
+            if (FD_ISSET(notify_read.fd, &read_fds)) {
+                while (read(notify_read.fd, &buffer[0], sizeof(buffer)) > 0)
+                    ;
+                if (decode_pool)
+                    take_decoded();
+                finish_recompute();
+            }
+            if (auto now = time(nullptr); last_periodic_check < now - alarm_timeout) {
+                periodic_check();
                 last_periodic_check = now;
             }
+            run_scheduled(udpsock.fd);
         } catch (std::runtime_error &ex) {
             syslog(LOG_ERR, "Got runtime error: %s\n", ex.what());
         } catch (std::exception &ex) {
@@ -359,6 +957,10 @@ int main(int argc, char *argv[]) {
             exit(1);
         } // and the rest, notably std::bad_alloc and std::logic_error and such, are reasons to crash
     }
-    
+
+    // stop the workers while the file descriptors they use are still open
+    decode_pool.reset();
+    route_worker.reset();
+    compute_worker.reset();
     return 0;
 }
@@ -0,0 +1,198 @@
+/* lvrouted-replay: run the route computation offline on the packets that a
+   live lvrouted captured in /tmp/packet-<addr>, with capture_packets on or
+   started with -C, to reproduce what it did and time it, or compare builds,
+   on a real topology.
+
+   The local addresses, which the daemon gets from the interfaces, are
+   given on the command line, and the settings come from a config file as
+   for lvrouted. Every run decodes and takes in all packets, derives the
+   routes and diffs them against a fake kernel that holds what the previous
+   run came up with. As in the daemon, a run starts from what the previous
+   one derived, so the runs after the first time a steady state. Afterwards,
+   the time every stage took is written to stderr and the routes to
+   stdout. */
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "Arena.hpp"
+#include "Config.hpp"
+#include "Discovery.hpp"
+#include "Neighbor.hpp"
+#include "Route.hpp"
+#include "Scheduler.hpp"
+
+static const char *capture_prefix = "packet-";
+
+struct Capture {
+    in_addr addr;
+    std::vector<uint8_t> data;
+};
+
+/* The captured packets in the given directory, in the order of their
+   addresses, so that every replay takes them in in the same order. */
+static std::vector<Capture> load_captures(const std::string &dir) {
+    std::unique_ptr<DIR, int (*)(DIR *)> d(opendir(dir.data()), closedir);
+    if (!d)
+        throw std::system_error(errno, std::system_category(), "opendir " + dir);
+    std::vector<Capture> res;
+    while (auto entry = readdir(d.get())) {
+        if (strncmp(entry->d_name, capture_prefix, strlen(capture_prefix)) != 0)
+            continue;
+        in_addr a;
+        if (inet_aton(entry->d_name + strlen(capture_prefix), &a) == 0)
+            continue;
+        std::ifstream ifs(dir + "/" + entry->d_name, std::ios::binary);
+        Capture c { in_addr { ntohl(a.s_addr) }, { std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() } };
+        res.push_back(std::move(c));
+    }
+    std::sort(res.begin(), res.end(), [](const Capture &a, const Capture &b) { return a.addr.s_addr < b.addr.s_addr; });
+    return res;
+}
+
+/* How long every run spent in one stage. */
+struct Stage {
+    const char *name;
+    std::vector<Clock::duration> times;
+
+    void report(std::ostream &os) {
+        std::sort(times.begin(), times.end());
+        auto us = [](Clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+        os << name << ": min " << us(times.front()) << " us, median " << us(times[times.size() / 2])
+           << " us, max " << us(times.back()) << " us" << std::endl;
+    }
+};
+
+static void usage() {
+    std::cerr << "usage: lvrouted-replay [-c config] [-s key] [-n runs] -a iface:addr/netmask [-a ...] dir" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    openlog("lvrouted-replay", LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    Settings command_line;
+    struct LocalAddr {
+        std::string iface;
+        in_addr addr;
+        int netmask;
+    };
+    std::vector<LocalAddr> local;
+    int runs = 10;
+    int c;
+    while ((c = getopt(argc, argv, "a:c:n:s:")) != -1) {
+        switch (c) {
+        case 'a': {
+            std::string arg = optarg;
+            auto colon = arg.find(':'), slash = arg.find('/');
+            in_addr a;
+            if (colon == std::string::npos || slash == std::string::npos || slash < colon ||
+                inet_aton(arg.substr(colon + 1, slash - colon - 1).data(), &a) == 0)
+                usage();
+            local.push_back({ arg.substr(0, colon), in_addr { ntohl(a.s_addr) }, atoi(arg.data() + slash + 1) });
+            break;
+        }
+        case 'c':
+            configfile = optarg;
+            break;
+        case 'n':
+            runs = std::max(1, atoi(optarg));
+            break;
+        case 's':
+            command_line["secret_key"] = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || local.empty())
+        usage();
+
+    Config config;
+    std::vector<Capture> captures;
+    try {
+        auto settings = read_settings(configfile);
+        for (auto &[name, value]: command_line)
+            settings[name] = value;
+        config = parse_settings(settings, current_config());
+        apply_globals(config);
+        captures = load_captures(argv[optind]);
+    } catch (std::runtime_error &ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    // what scan_interfaces() makes of the interfaces
+    RouteSet direct_nets;
+    Discovery discovery;
+    std::vector<std::string> iface_names;
+    for (auto &l: local) {
+        auto iface = static_cast<IfaceIndex>(std::find(iface_names.begin(), iface_names.end(), l.iface) - iface_names.begin());
+        if (iface == iface_names.size())
+            iface_names.push_back(l.iface);
+        Route r;
+        r.addr = l.addr;
+        r.netmask = l.netmask;
+        r.gateways = NextHops(l.addr);
+        direct_nets.insert(r);
+        if (l.netmask >= interlink_netmask && l.netmask < 32)
+            discovery.add_subnet(iface, l.addr, l.netmask);
+    }
+    std::vector<bool> zero_hop;
+    for (auto &name: iface_names)
+        zero_hop.push_back(config.zero_hop_ifaces.count(name) > 0);
+
+    Stage decode { "decode", {} }, derive { "derive", {} }, compare { "diff", {} };
+    Arena arena;
+    Damping damping(std::chrono::seconds(config.damping_half_life), std::chrono::seconds(config.damping_max_suppress));
+    Derived derived;
+    RouteSet kernel; // the fake one
+    size_t first_changes = 0, later_changes = 0;
+    for (int run = 0; run < runs; run++) {
+        arena.reset();
+        auto start = Clock::now();
+        NeighborTable neighbors;
+        for (auto &capture: captures) {
+            try {
+                auto iface = discovery.iface_for(capture.addr);
+                if (!iface)
+                    throw std::runtime_error("Packet from " + show(capture.addr) + " isn't from an interlink");
+                apply_packet(neighbors, decode_packet(capture.data.data(), capture.data.size(), capture.addr, timeval { 0, 0 }, secret_key), iface);
+            } catch (std::runtime_error &ex) {
+                if (run == 0)
+                    syslog(LOG_WARNING, "Skipping capture: %s", ex.what());
+            }
+        }
+        auto decoded = Clock::now();
+        derive_routes_and_mytree(direct_nets, neighbors, config.default_gateways, zero_hop, damping, arena, derived);
+        auto computed = Clock::now();
+        auto [deletes, adds, changes] = diff(kernel, derived.routes);
+        auto diffed = Clock::now();
+
+        (run == 0 ? first_changes : later_changes) += deletes.size() + adds.size() + changes.size();
+        kernel = derived.routes;
+        decode.times.push_back(decoded - start);
+        derive.times.push_back(computed - decoded);
+        compare.times.push_back(diffed - computed);
+    }
+
+    std::cerr << captures.size() << " packets, " << kernel.size() << " routes, " << runs << " runs" << std::endl;
+    decode.report(std::cerr);
+    derive.report(std::cerr);
+    compare.report(std::cerr);
+    std::cerr << first_changes << " route changes on the first run, " << later_changes << " after" << std::endl;
+    for (const auto &route: kernel)
+        std::cout << show(route) << std::endl;
+    // the same packets should give the same routes every time
+    return later_changes == 0 ? 0 : 2;
+}
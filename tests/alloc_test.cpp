@@ -0,0 +1,135 @@
+/* Counts the heap allocations of a steady-state route computation: deriving
+   the routes and the tree, diffing the routes against the ones installed
+   and encoding the tree for the wire, as a run and the broadcast after it
+   do. The scratch data of derive_routes_and_mytree() comes from an Arena,
+   and a run that comes up with the same routes and tree as the previous one
+   keeps those rather than building them again, so once the arena has grown
+   to the working size, such a run allocates nothing at all.
+
+   That is what's enforced here, along with what's kept being what a run
+   from scratch comes up with, also after the topology changed. Exits
+   non-zero if either doesn't hold. */
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include "Arena.hpp"
+#include "common.hpp"
+#include "Neighbor.hpp"
+
+static size_t allocations = 0;
+static bool counting = false;
+
+void *operator new(size_t size) {
+    if (counting)
+        allocations++;
+    if (auto p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << std::endl;
+        exit(1);
+    }
+}
+
+static in_addr addr(uint32_t n) {
+    return in_addr { 0xac100000 + n };
+}
+
+/* The tree neighbor k sends: 25 nodes with 19 children each, drawn from
+   a pool of addresses that overlaps with what the other neighbors send, so
+   that merge() sees most nodes more than once. */
+static std::shared_ptr<const Node> neighbor_tree(uint32_t k) {
+    auto top = std::make_shared<Node>();
+    for (uint32_t i = 0; i < 25; i++) {
+        auto child = std::make_shared<Node>();
+        child->addr = addr(0x1000 + ((k * 5 + i) % 100) * 32);
+        child->metric = 10 + i % 7;
+        child->gateway = i == 3;
+        for (uint32_t j = 1; j < 20; j++) {
+            auto grandchild = std::make_shared<Node>();
+            grandchild->addr = addr(child->addr.s_addr - 0xac100000 + j);
+            grandchild->metric = 10 + (j + k) % 5;
+            child->children.push_back(grandchild);
+        }
+        top->children.push_back(child);
+    }
+    return top;
+}
+
+/* Check that the given results are what a run from scratch comes up with. */
+static void check_fresh(const Derived &derived, const RouteSet &direct_nets, const NeighborTable &neighbors,
+                        const InAddrSet &default_gateways, const std::vector<bool> &zero_hop, const std::string &when) {
+    Arena arena;
+    Damping damping { std::chrono::seconds(damping_half_life), std::chrono::seconds(damping_max_suppress) };
+    Derived fresh;
+    derive_routes_and_mytree(direct_nets, neighbors, default_gateways, zero_hop, damping, arena, fresh);
+    check(fresh.routes == derived.routes, "the routes kept " + when + " are those of a run from scratch");
+    check(same_tree(fresh.tree, derived.tree), "the tree kept " + when + " is that of a run from scratch");
+}
+
+int main() {
+    NeighborTable neighbors;
+    for (uint32_t k = 0; k < 20; k++) {
+        Neighbor n {};
+        n.iface = 0;
+        n.addr = addr(k * 4 + 1);
+        n.tree = neighbor_tree(k);
+        neighbors.insert(std::move(n));
+    }
+    RouteSet direct_nets;
+    Route r;
+    r.addr = addr(0);
+    r.netmask = 30;
+    r.gateways = NextHops(addr(2));
+    direct_nets.insert(r);
+    std::vector<bool> zero_hop { false };
+    InAddrSet default_gateways;
+
+    for (bool optimal: { false, true }) {
+        optimal_aggregation = optimal;
+        auto mode = std::string(optimal ? "optimal" : "usual") + " aggregation";
+        // on, as by default. once its copies of the routes have grown, it allocates nothing either
+        Damping damping { std::chrono::seconds(damping_half_life), std::chrono::seconds(damping_max_suppress) };
+        Arena arena;
+        Derived derived;
+        RouteSet installed;
+        // the topology changes after the first five runs: a neighbor goes away
+        auto gone = neighbors.find(addr(7 * 4 + 1))->tree;
+        for (int run = 0; run < 10; run++) {
+            if (run == 5)
+                neighbors.find(addr(7 * 4 + 1))->tree.reset();
+            arena.reset();
+            allocations = 0;
+            counting = true;
+            derive_routes_and_mytree(direct_nets, neighbors, default_gateways, zero_hop, damping, arena, derived);
+            auto [deletes, adds, changes] = diff(installed, derived.routes);
+            all_sent(neighbors, derived.tree); // brings the encoded tree up to date
+            counting = false;
+            auto changed = deletes.size() + adds.size() + changes.size();
+            std::cout << mode << ", run " << run << ": " << allocations << " allocations, "
+                      << derived.routes.size() << " routes, " << changed << " changed" << std::endl;
+            check(!derived.routes.empty() && !derived.tree.empty(), "the run found routes");
+            check_fresh(derived, direct_nets, neighbors, default_gateways, zero_hop, "after run " + std::to_string(run));
+            check((changed > 0) == (run == 0 || run == 5), "routes change when the topology does, and only then");
+            installed = derived.routes;
+            // the first run, and the first after the change, grow the arena and the damping's copies
+            if (run != 0 && run != 1 && run != 5 && run != 6)
+                check(allocations == 0, "a run that changes nothing allocates nothing");
+        }
+        neighbors.find(addr(7 * 4 + 1))->tree = gone;
+    }
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,157 @@
+/* Checks for the limits of the tree codec and of merge(): the child count
+   escape on the wire, the most children a node can have and the deepest a
+   tree can be, for trees we build as well as for what comes in from the
+   network. Exits non-zero on the first check that fails. */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "Tree.hpp"
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << std::endl;
+        exit(1);
+    }
+}
+
+/* Whether the given call throws a runtime_error with the given message. */
+template<typename F>
+static bool throws(F f, const char *message) {
+    try {
+        f();
+    } catch (std::runtime_error &ex) {
+        return strcmp(ex.what(), message) == 0;
+    }
+    return false;
+}
+
+static NodePtr leaf(uint32_t n, uint16_t metric = 10) {
+    auto res = std::make_shared<Node>();
+    res->addr.s_addr = 0xac100000 + n;
+    res->metric = metric;
+    return res;
+}
+
+/* A top node with the given number of children, all leaves. */
+static Node wide(size_t children) {
+    Node top {};
+    top.addr.s_addr = 0xac100000; // what the top node comes out as
+    for (size_t i = 0; i < children; i++)
+        top.children.push_back(leaf(i + 1, i % 300)); // some metrics need the escape too
+    return top;
+}
+
+/* A top node with a chain of the given number of nodes below it, which
+   makes the tree that deep. */
+static Node chain(size_t length) {
+    NodePtr below;
+    for (size_t i = length; i > 0; i--) {
+        auto n = std::make_shared<Node>();
+        n->addr.s_addr = 0xac100000 + i;
+        n->metric = 1;
+        if (below)
+            n->children.push_back(below);
+        below = n;
+    }
+    Node top {};
+    top.addr.s_addr = 0xac100000;
+    if (below)
+        top.children.push_back(below);
+    return top;
+}
+
+static Node round_trip(const Node &n) {
+    std::vector<uint8_t> buf(serialized_size(n));
+    check(serialize(n, buf.data(), buf.size()) == buf.size(), "serialize() writes serialized_size() bytes");
+    return deserialize(buf.data(), buf.size());
+}
+
+/* A chain of the given depth as it would be on the wire, built by hand
+   since serialize() won't make one that's too deep. */
+static std::vector<uint8_t> chain_on_wire(size_t depth) {
+    std::vector<uint8_t> res;
+    for (size_t i = 0; i <= depth; i++) {
+        uint32_t word = htonl((i < depth ? 1u << 22 : 0) | static_cast<uint32_t>(i));
+        auto p = reinterpret_cast<const uint8_t *>(&word);
+        res.insert(res.end(), p, p + sizeof(word));
+        res.push_back(1); // the metric
+    }
+    return res;
+}
+
+static void test_children() {
+    for (size_t n: { size_t(1022), size_t(1023), size_t(10000), max_children }) {
+        auto top = wide(n);
+        check(round_trip(top) == top, std::to_string(n) + " children survive the wire");
+    }
+    auto too_wide = wide(max_children + 1);
+    check(throws([&] { serialized_size(too_wide); }, "Too many children in tree node"),
+          "serialized_size() refuses too many children");
+    std::vector<uint8_t> buf(8 * (max_children + 1));
+    check(throws([&] { serialize(too_wide, buf.data(), buf.size()); }, "Too many children in tree node"),
+          "serialize() refuses too many children");
+
+    // a child count that the rest of the packet can't hold
+    auto top = wide(10000);
+    std::vector<uint8_t> wire(serialized_size(top));
+    serialize(top, wire.data(), wire.size());
+    check(throws([&] { deserialize(wire.data(), wire.size() - 5); }, "Faulty packet"),
+          "deserialize() rejects a node missing a child");
+}
+
+static void test_depth() {
+    for (size_t n: { size_t(100), max_tree_depth }) {
+        auto top = chain(n);
+        check(round_trip(top) == top, "a chain of " + std::to_string(n) + " survives the wire");
+    }
+    auto too_deep = chain(max_tree_depth + 1);
+    check(throws([&] { serialized_size(too_deep); }, "Tree too deep"), "serialized_size() refuses a tree that's too deep");
+
+    auto wire = chain_on_wire(100);
+    auto decoded = deserialize(wire.data(), wire.size());
+    size_t depth = 0;
+    for (const Node *n = &decoded; !n->children.empty(); n = n->children.front().get())
+        depth++;
+    check(depth == 100, "a chain of 100 from the wire comes out whole");
+    wire = chain_on_wire(max_tree_depth);
+    deserialize(wire.data(), wire.size());
+    for (size_t n: { max_tree_depth + 1, size_t(10000) }) {
+        wire = chain_on_wire(n);
+        check(throws([&] { deserialize(wire.data(), wire.size()); }, "Tree too deep"),
+              "deserialize() rejects a chain of " + std::to_string(n));
+    }
+}
+
+/* merge() doesn't go deeper than max_tree_depth, counting the neighbor as
+   the first hop, and every hop up to there gets a route through it. */
+static void test_merge_depth() {
+    for (size_t n: { size_t(100), max_tree_depth + 100 }) {
+        auto top = chain(n);
+        Arena arena;
+        ScratchVector<MergeRoot> roots { ArenaAllocator<MergeRoot>(arena) };
+        roots.push_back({ leaf(0xfffff)->addr, false, false, 10, &top.children });
+        std::vector<NodePtr> tree;
+        auto [routes, gateways] = merge(roots, tree, arena);
+        auto hops = std::min(n + 1, max_tree_depth);
+        check(routes.size() == hops, "merge() of a chain of " + std::to_string(n) + " gives " + std::to_string(hops) + " routes");
+        for (auto &r: routes)
+            check(r.gateways.size() == 1 && r.gateways.front().s_addr == 0xac1fffff, "every hop is reached through the neighbor");
+        Node top_of_tree {};
+        top_of_tree.addr.s_addr = 0xac100000;
+        top_of_tree.children = tree;
+        check(same_tree(round_trip(top_of_tree).children, tree), "what merge() built goes on the wire");
+    }
+}
+
+int main() {
+    test_children();
+    test_depth();
+    test_merge_depth();
+    std::cout << "ok" << std::endl;
+}